@@ -26,240 +26,1368 @@
 #include <stdlib.h>
 #include <alloca.h>
 #include <stdio.h>
+#include <string.h> /* memcpy */
 #include "../../stack.h"
+#include "../../funge-space/funge-space.h"
+#include "../../diagnostic.h"
+#define FUNGE_EXTENDS_CFFI
 #include "CFFI.h"
-void ** pstack=NULL;
-int stack_ptr;
-static inline void * popp(void){
-  register void * p = pstack[stack_ptr-1];
-  stack_ptr--;
-  pstack=realloc(pstack,stack_ptr*sizeof(void *));
-  return p;
 
+/// A block of memory for temporary strings.
+typedef struct s_cffiArena {
+	struct s_cffiArena * next;   ///< The previous, smaller block.
+	size_t               size;   ///< Size of data.
+	size_t               used;   ///< Bytes of data handed out.
+	unsigned char        data[];
+} cffiArena;
+
+/// Per-IP state: the pointer stack and temporary strings.
+typedef struct s_cffiState {
+	void      ** pointers; ///< The pointers, top at pointers[top - 1].
+	size_t       top;      ///< Number of pointers on the stack.
+	size_t       size;     ///< Number of pointers allocated. Never shrinks.
+	cffiArena  * arena;    ///< Temporary strings, newest block first.
+} cffiState;
+
+/// Initial size of the pointer stack.
+#define CFFI_PSTACK_INITIAL 16
+/// Size of the first block of temporary strings.
+#define CFFI_ARENA_INITIAL 4096
+
+static inline void * popp(instructionPointer * ip)
+{
+	cffiState * state = ip->fingerCFFIstate;
+	// Like the Funge stack, an empty pointer stack gives "zeros".
+	if (FUNGE_UNLIKELY(state->top == 0))
+		return NULL;
+	return state->pointers[--state->top];
+}
+
+static inline void pushp(instructionPointer * ip, void * p)
+{
+	cffiState * state = ip->fingerCFFIstate;
+	if (FUNGE_UNLIKELY(state->top == state->size)) {
+		size_t newSize = state->size * 2;
+		void ** newPointers = realloc(state->pointers, newSize * sizeof(void*));
+		if (FUNGE_UNLIKELY(!newPointers))
+			DIAG_OOM("Could not grow CFFI pointer stack");
+		state->pointers = newPointers;
+		state->size = newSize;
+	}
+	state->pointers[state->top++] = p;
+}
+
+FUNGE_ATTR_FAST void * finger_CFFI_pop_pointer(instructionPointer * restrict ip)
+{
+	return popp(ip);
+}
+
+FUNGE_ATTR_FAST void finger_CFFI_push_pointer(instructionPointer * restrict ip, void * p)
+{
+	pushp(ip, p);
+}
+
+FUNGE_ATTR_FAST unsigned char * finger_CFFI_temporary(instructionPointer * restrict ip, size_t size)
+{
+	cffiState * state = ip->fingerCFFIstate;
+	cffiArena * block = state->arena;
+	unsigned char * p;
+
+	if (FUNGE_UNLIKELY(!block || block->size - block->used < size)) {
+		// Blocks double in size, so resetting can keep just the newest.
+		size_t blockSize = block ? block->size * 2 : CFFI_ARENA_INITIAL;
+		if (blockSize < size)
+			blockSize = size;
+		if (FUNGE_UNLIKELY(blockSize > SIZE_MAX - sizeof(cffiArena)))
+			return NULL;
+		block = malloc(sizeof(cffiArena) + blockSize);
+		if (FUNGE_UNLIKELY(!block))
+			return NULL;
+		block->next = state->arena;
+		block->size = blockSize;
+		block->used = 0;
+		state->arena = block;
+	}
+	p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+/// Free all temporary strings, keeping the newest block for reuse.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void reset_temporary(cffiState * restrict state)
+{
+	cffiArena * block = state->arena;
+
+	if (!block)
+		return;
+	while (block->next) {
+		cffiArena * old = block->next;
+		block->next = old->next;
+		free(old);
+	}
+	block->used = 0;
+}
+
+FUNGE_ATTR_FAST void finger_CFFI_end_call(instructionPointer * restrict ip, instructionPointer * caller)
+{
+	finger_CFFI_caller = caller;
+	// Callbacks can't free the strings of the calls they are nested in.
+	if (!caller)
+		reset_temporary(ip->fingerCFFIstate);
+}
+
+/// Peek at the top of the pointer stack.
+#define peekp(m_ip) \
+	((m_ip)->fingerCFFIstate->top ? (m_ip)->fingerCFFIstate->pointers[(m_ip)->fingerCFFIstate->top - 1] : NULL)
+
+/*
+ * Library and symbol cache. Programs look up the same few libraries and
+ * symbols every run, and dlopen() and dlsym() search for them each time, so
+ * handles and symbols are kept here by name for the whole process. A library
+ * is only dlclose()d when U has been used as many times as L, and then its
+ * symbols are forgotten. Libraries from -L are pinned and never closed, so
+ * the symbols handed out by CFFX G stay valid.
+ */
+
+/// Number of buckets in the library and in the symbol hash table.
+#define CFFI_CACHE_BUCKETS 64
+
+typedef struct s_cffiLibrary {
+	struct s_cffiLibrary * next;
+	void                 * handle;
+	size_t                 opens;  ///< Number of L not matched by U yet.
+	bool                   pinned; ///< Loaded by -L, U never closes it.
+	char                   name[];
+} cffiLibrary;
+
+typedef struct s_cffiSymbol {
+	struct s_cffiSymbol * next;
+	void                * handle;  ///< Library the symbol is from.
+	void                * address;
+	char                  name[];
+} cffiSymbol;
+
+static cffiLibrary * libraries[CFFI_CACHE_BUCKETS];
+static cffiSymbol  * symbols[CFFI_CACHE_BUCKETS];
+
+/// Symbols from -L, in the order given.
+static void  ** preloaded      = NULL;
+static size_t   preloadedCount = 0;
+
+/// FNV-1a of a string, continuing from hash.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE
+static inline uint32_t hash_name(uint32_t hash, const char * restrict name)
+{
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/// Hash of a symbol name in a library.
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE
+static inline uint32_t hash_symbol(const void * handle, const char * restrict name)
+{
+	return hash_name(2166136261U ^ (uint32_t)((uintptr_t)handle >> 4), name);
+}
+
+/**
+ * dlopen() a library, or get it from the cache.
+ * @param name Name of the library, NULL for the program itself.
+ * @return The handle, or NULL on failure.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static void * open_library(const char * name)
+{
+	const char * key = name ? name : "";
+	uint32_t bucket = hash_name(2166136261U, key) % CFFI_CACHE_BUCKETS;
+	cffiLibrary * lib;
+	void * handle;
+	size_t length;
+
+	for (lib = libraries[bucket]; lib; lib = lib->next) {
+		if (strcmp(lib->name, key) == 0) {
+			lib->opens++;
+			return lib->handle;
+		}
+	}
+	handle = dlopen(name, RTLD_LAZY);
+	if (!handle)
+		return NULL;
+	length = strlen(key);
+	lib = malloc(sizeof(cffiLibrary) + length + 1);
+	// It works without the cache too.
+	if (FUNGE_UNLIKELY(!lib))
+		return handle;
+	memcpy(lib->name, key, length + 1);
+	lib->handle = handle;
+	lib->opens = 1;
+	lib->pinned = false;
+	lib->next = libraries[bucket];
+	libraries[bucket] = lib;
+	return handle;
+}
+
+/**
+ * Undo an open_library(), dlclose()ing the library if nothing else has it
+ * open. Handles that aren't in the cache are just dlclose()d.
+ * @return 0 on success, non-zero on failure like dlclose().
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static int close_library(void * handle)
+{
+	for (size_t i = 0; i < CFFI_CACHE_BUCKETS; i++) {
+		for (cffiLibrary ** prev = &libraries[i]; *prev; prev = &(*prev)->next) {
+			cffiLibrary * lib = *prev;
+			if (lib->handle != handle)
+				continue;
+			if (lib->pinned)
+				return 0;
+			if (--lib->opens != 0)
+				return 0;
+			*prev = lib->next;
+			free(lib);
+			goto close;
+		}
+	}
+close:
+	// The handle may be reused for another library later.
+	for (size_t i = 0; i < CFFI_CACHE_BUCKETS; i++) {
+		cffiSymbol ** prev = &symbols[i];
+		while (*prev) {
+			cffiSymbol * sym = *prev;
+			if (sym->handle == handle) {
+				*prev = sym->next;
+				free(sym);
+			} else {
+				prev = &sym->next;
+			}
+		}
+	}
+	return dlclose(handle);
+}
+
+/**
+ * Make sure a library from open_library() is never closed.
+ * @return False if it isn't in the cache (out of memory), so it can't be
+ *         pinned.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static bool pin_library(void * handle)
+{
+	for (size_t i = 0; i < CFFI_CACHE_BUCKETS; i++) {
+		for (cffiLibrary * lib = libraries[i]; lib; lib = lib->next) {
+			if (lib->handle == handle) {
+				lib->pinned = true;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/**
+ * dlsym() a symbol, or get it from the cache.
+ * @param found Set to true if the symbol was found, even if its address is
+ *              NULL.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static void * find_symbol(void * handle, const char * restrict name, bool * restrict found)
+{
+	uint32_t bucket = hash_symbol(handle, name) % CFFI_CACHE_BUCKETS;
+	cffiSymbol * sym;
+	void * address;
+	size_t length;
+
+	for (sym = symbols[bucket]; sym; sym = sym->next) {
+		if (sym->handle == handle && strcmp(sym->name, name) == 0) {
+			*found = true;
+			return sym->address;
+		}
+	}
+	dlerror();
+	address = dlsym(handle, name);
+	if (dlerror()) {
+		*found = false;
+		return NULL;
+	}
+	*found = true;
+	length = strlen(name);
+	sym = malloc(sizeof(cffiSymbol) + length + 1);
+	if (FUNGE_UNLIKELY(!sym))
+		return address;
+	memcpy(sym->name, name, length + 1);
+	sym->handle = handle;
+	sym->address = address;
+	sym->next = symbols[bucket];
+	symbols[bucket] = sym;
+	return address;
+}
+
+FUNGE_ATTR_FAST bool finger_CFFI_preload(const char * spec)
+{
+	const char * colon = strrchr(spec, ':');
+	char * library = NULL;
+	void ** newPreloaded;
+	void * handle;
+	void * address;
+	bool found;
+
+	if (!colon || colon[1] == '\0')
+		return false;
+	if (colon != spec) {
+		size_t length = (size_t)(colon - spec);
+		library = malloc(length + 1);
+		if (FUNGE_UNLIKELY(!library))
+			return false;
+		memcpy(library, spec, length);
+		library[length] = '\0';
+	}
+	handle = open_library(library);
+	free(library);
+	if (!handle || !pin_library(handle))
+		return false;
+	address = find_symbol(handle, colon + 1, &found);
+	if (!found)
+		return false;
+	newPreloaded = realloc(preloaded, (preloadedCount + 1) * sizeof(void*));
+	if (FUNGE_UNLIKELY(!newPreloaded))
+		return false;
+	preloaded = newPreloaded;
+	preloaded[preloadedCount++] = address;
+	return true;
 }
 
-static inline void pushp(void * p){
-  stack_ptr++;
-  pstack=realloc(pstack,stack_ptr*sizeof(void *));
-  pstack[stack_ptr-1]=p;
-  
+FUNGE_ATTR_FAST bool finger_CFFI_get_preloaded(funge_cell id, void ** address)
+{
+	if (id < 0 || (size_t)id >= preloadedCount)
+		return false;
+	*address = preloaded[id];
+	return true;
 }
+
 /* B - get char from string */
 static void finger_CFFI_getbyte(instructionPointer * ip)
 {
-
-    char * str=popp();
-    funge_cell index=stack_pop(ip->stack);
-    stack_push(ip->stack,str[index]);
+	char * str = popp(ip);
+	funge_cell index = stack_pop(ip->stack);
+	stack_push(ip->stack, str[index]);
 }
 /* F - free pointer */
-static void finger_CFFI_free(instructionPointer * ip){
-	(void) ip;
-    free(popp());
+static void finger_CFFI_free(instructionPointer * ip)
+{
+	free(popp(ip));
 }
 /* S - generate_string */
 static void finger_CFFI_generate_string(instructionPointer * ip)
 {
-    char * str=malloc(512*sizeof(char));
-    int i=0;
-    char c;
-    do{
-       c=(char)stack_pop(ip->stack);
-       str[i]=c;
-       i++;
-       if (i%512==0){
-         str=realloc(str,(i+512)*sizeof(char));
-       }
-        
-
-    } while(c);
-    str=realloc(str, i+1);
-    pushp(str);
-        
-        
+	unsigned char * str = stack_pop_string(ip->stack, NULL);
+	if (FUNGE_UNLIKELY(!str)) {
+		ip_reverse(ip);
+		return;
+	}
+	pushp(ip, str);
 }
 static void finger_CFFI_swap(instructionPointer * ip)
 {
-  (void) ip;
-  void * ptr1=popp();
-  void * ptr2=popp();
-  pushp(ptr1);
-  pushp(ptr2);
-}
-static void finger_CFFI_dereference(instructionPointer * ip){
-  funge_cell index=stack_pop(ip->stack);
-  funge_cell * arr=popp();
-  stack_push(ip->stack,arr[index]);
-}
-static void finger_CFFI_write_to_arr(instructionPointer * ip){
-  funge_cell index=stack_pop(ip->stack);
-  funge_cell data=stack_pop(ip->stack);
-  funge_cell * arr=popp();
-  arr[index]=data;
-}
-static void finger_CFFI_dlclose(instructionPointer * ip){
-  if(dlclose(popp())){
-    ip_reverse(ip);
-  }
-}
-static void finger_CFFI_dlsym(instructionPointer * ip){
-  char * token_name=popp();
-  void * library=popp();
-  dlerror();
-  void * token=dlsym(library,token_name);
-  if (dlerror()){
-    ip_reverse(ip);
-  } else {
-    pushp(token);
-  }
-}
-static void finger_CFFI_funge_to_pointer(instructionPointer * ip){
-  funge_cell low=stack_pop(ip->stack);
-  funge_cell high=stack_pop(ip->stack);
-  uint64_t ptr=(((uint64_t)(uint32_t)high)<<32)|((uint32_t)low);
-  pushp((void*)ptr);
-}
-static void finger_CFFI_print_pstack(instructionPointer * ip){
-  (void) ip;
-  for (int i=stack_ptr-1; i>=0; i--){
-    if (pstack[i]){
-      printf("%d: %lx (First Word is %d)\n",i, (long unsigned int)pstack[i],*(int *)(pstack[i]));
-    } else {
-      printf("%d: NULL\n",i);
-    }
-  }
-  printf("\n");
-}
-static void finger_CFFI_malloc(instructionPointer * ip){
-  funge_cell len=stack_pop(ip->stack);
-  funge_cell * arr=malloc(sizeof(funge_cell)*sizeof(len));
-  for (int i=0; i<len; i++){
-    arr[i]=stack_pop(ip->stack);
-  }
-  pushp(arr);
-}
-static void finger_CFFI_dlopen(instructionPointer * ip){
-  char * libname=popp();
-  void * library=dlopen(libname,RTLD_LAZY);
-  if (!library){
-    ip_reverse(ip);
-  } else {
-    pushp(library);
-  }
-}
-static void finger_CFFI_popp(instructionPointer * ip){
-  (void) ip;
-  popp();
-}
-static void finger_CFFI_pointer_to_funge(instructionPointer * ip){
-  uint64_t ptr=(uint64_t)popp();
-  funge_cell high=(funge_cell)(ptr/(1L<<32));
-  funge_cell low=(funge_cell)(ptr%(1L<<32));
-  stack_push(ip->stack, high); stack_push(ip->stack,low);
-}
-static void finger_CFFI_duplicate(instructionPointer * ip){
-  (void) ip;
-  pushp(pstack[stack_ptr-1]);
-}
-
-void finger_CFFI_ccall(instructionPointer * ip){
-  /* Figure out Return Type */
-  funge_cell return_type_i=stack_pop(ip->stack);
-  ffi_type * return_type;
-  switch(return_type_i){
-    case 0:
-      return_type=&ffi_type_uint32;
-      break;
-    case 1:
-      return_type=&ffi_type_pointer;
-    break;
-    default:
-      return_type=&ffi_type_void;
-      break;
-  }
-  
-  /* get the types (funge/pointer) of all the arguments */
-  funge_cell len=stack_pop(ip->stack); /* Amount of arguments */
-  ffi_type ** argtypes=alloca(len*sizeof(ffi_type*)); 
-  {
-  signed long long lensave=len;
-  int count=0;
-  /* set argument to pointer if pointer and uint32 if funge */
-  while(lensave>0){	
-    /* Get (part of if over 32 arguments) the bitmask for the arguments*/
-    funge_cell cur=stack_pop(ip->stack); 
-    for (int i=0; (i<sizeof(funge_cell)*8)&&(lensave>0); i++){
-      if (cur&1){
-        argtypes[count]=&ffi_type_pointer;
-      } else {
-        argtypes[count]=&ffi_type_uint32;
-      }
-      cur>>=1;
-      count++;
-     lensave--;
-    }
-    }
-  }
-  /* pop the arguments from the correct stack based on the bitmask */
-  void ** arguments=alloca(len*sizeof(void *));
-  {
-    for (int i=0; i<len; i++){
-      if(argtypes[i]==&ffi_type_uint32){
-        funge_cell * p=arguments[i]=alloca(sizeof(funge_cell *));
-        *p=stack_pop(ip->stack);
-      }else if(argtypes[i]==&ffi_type_pointer){
-        void ** p=arguments[i]=alloca(sizeof(void *));
-        *p=popp();
-      } else {
-        fprintf(stderr, "This isn't supposed to happen\n");
-        exit(3);
-      }
-    }
-  }
-  /* Pop Function Pointer */
-  void (*func)(void)=popp();
-  ffi_cif cif;
-  void * return_value=alloca(16); /* CFFI doesn't support raw structs the biggest data type would be 8 bytes, but I am allocating 16 for good measure */
-  
-  /* Call the function using libffi */
-  ffi_prep_cif(&cif,FFI_DEFAULT_ABI, len, return_type, argtypes);
-  ffi_call(&cif,func,return_value,arguments);
-
-  /* Push the return value to the correct stack based on the return value */
-  switch(return_type_i){
-    case 0:
-    //return_type=&ffi_type_uint32;
-      stack_push(ip->stack,*(funge_cell*)return_value);
-    break;
-    case 1:
-      //return_type=&ffi_type_pointer;
-      pushp(*(void**)return_value);
-    break;
-  }
+	void * ptr1 = popp(ip);
+	void * ptr2 = popp(ip);
+	pushp(ip, ptr1);
+	pushp(ip, ptr2);
+}
+static void finger_CFFI_dereference(instructionPointer * ip)
+{
+	funge_cell index = stack_pop(ip->stack);
+	funge_cell * arr = popp(ip);
+	stack_push(ip->stack, arr[index]);
+}
+static void finger_CFFI_write_to_arr(instructionPointer * ip)
+{
+	funge_cell index = stack_pop(ip->stack);
+	funge_cell data = stack_pop(ip->stack);
+	funge_cell * arr = popp(ip);
+	arr[index] = data;
+}
+static void finger_CFFI_dlclose(instructionPointer * ip)
+{
+	if (close_library(popp(ip))) {
+		ip_reverse(ip);
+	}
+}
+static void finger_CFFI_dlsym(instructionPointer * ip)
+{
+	char * token_name = popp(ip);
+	void * library = popp(ip);
+	void * token;
+	bool found;
+	if (FUNGE_UNLIKELY(!token_name)) {
+		ip_reverse(ip);
+		return;
+	}
+	token = find_symbol(library, token_name, &found);
+	if (!found) {
+		ip_reverse(ip);
+	} else {
+		pushp(ip, token);
+	}
+}
+static void finger_CFFI_funge_to_pointer(instructionPointer * ip)
+{
+	funge_cell low = stack_pop(ip->stack);
+	funge_cell high = stack_pop(ip->stack);
+	uint64_t ptr = (((uint64_t)(uint32_t)high) << 32) | ((uint32_t)low);
+	pushp(ip, (void*)(uintptr_t)ptr);
+}
+static void finger_CFFI_print_pstack(instructionPointer * ip)
+{
+	const cffiState * state = ip->fingerCFFIstate;
+	for (size_t i = state->top; i-- > 0;) {
+		if (state->pointers[i]) {
+			printf("%zu: %lx (First Word is %d)\n", i, (long unsigned int)(uintptr_t)state->pointers[i], *(int *)(state->pointers[i]));
+		} else {
+			printf("%zu: NULL\n", i);
+		}
+	}
+	printf("\n");
+}
+static void finger_CFFI_malloc(instructionPointer * ip)
+{
+	funge_cell len = stack_pop(ip->stack);
+	funge_cell * arr;
+
+	if (len < 0 || (size_t)len >= SIZE_MAX / sizeof(funge_cell)) {
+		ip_reverse(ip);
+		return;
+	}
+	arr = malloc(sizeof(funge_cell) * ((size_t)len + 1));
+	if (FUNGE_UNLIKELY(!arr)) {
+		ip_reverse(ip);
+		return;
+	}
+	// The top of the stack goes first.
+	stack_pop_cells(ip->stack, arr, (size_t)len);
+	for (size_t i = 0, j = (size_t)len; i + 1 < j; i++, j--) {
+		funge_cell tmp = arr[i];
+		arr[i] = arr[j - 1];
+		arr[j - 1] = tmp;
+	}
+	pushp(ip, arr);
+}
+static void finger_CFFI_dlopen(instructionPointer * ip)
+{
+	char * libname = popp(ip);
+	void * library = open_library(libname);
+	if (!library) {
+		ip_reverse(ip);
+	} else {
+		pushp(ip, library);
+	}
+}
+static void finger_CFFI_popp(instructionPointer * ip)
+{
+	popp(ip);
+}
+static void finger_CFFI_pointer_to_funge(instructionPointer * ip)
+{
+	void * p = popp(ip);
+	uint64_t ptr = (uint64_t)(uintptr_t)p;
+	funge_cell high = (funge_cell)(ptr / (1L << 32));
+	funge_cell low = (funge_cell)(ptr % (1L << 32));
+	stack_push(ip->stack, high);
+	stack_push(ip->stack, low);
+}
+static void finger_CFFI_duplicate(instructionPointer * ip)
+{
+	pushp(ip, peekp(ip));
+}
+
+/*
+ * Types. Every type has a code: the basic types (see CFFI.h), and structs
+ * declared with N get codes from CFFI_TYPE_STRUCT up. Values are moved
+ * between C and Funge by finger_CFFI_pop_value() and
+ * finger_CFFI_push_value(), which are used for arguments, return values and
+ * J/K alike.
+ */
+
+/// Largest number of arguments in a call, or of members in a struct.
+#define CFFI_MAX_ARGS 256
+
+static ffi_type * const type_table[CFFI_TYPE_COUNT] = {
+	[CFFI_TYPE_UINT32]  = &ffi_type_uint32,
+	[CFFI_TYPE_POINTER] = &ffi_type_pointer,
+	[CFFI_TYPE_VOID]    = &ffi_type_void,
+	[CFFI_TYPE_INT8]    = &ffi_type_sint8,
+	[CFFI_TYPE_UINT8]   = &ffi_type_uint8,
+	[CFFI_TYPE_INT16]   = &ffi_type_sint16,
+	[CFFI_TYPE_UINT16]  = &ffi_type_uint16,
+	[CFFI_TYPE_INT32]   = &ffi_type_sint32,
+	[CFFI_TYPE_INT64]   = &ffi_type_sint64,
+	[CFFI_TYPE_UINT64]  = &ffi_type_uint64,
+	[CFFI_TYPE_FLOAT]   = &ffi_type_float,
+	[CFFI_TYPE_DOUBLE]  = &ffi_type_double
+};
+
+/// A declared struct layout. Never freed.
+typedef struct s_cffiStruct {
+	ffi_type   type;
+	size_t     count;       ///< Number of members.
+	uint32_t * codes;       ///< Type codes of the members.
+	size_t   * offsets;     ///< Offsets of the members.
+	ffi_type * elements[];  ///< Member types, NULL terminated, for libffi.
+} cffiStruct;
+
+static cffiStruct ** structs     = NULL;
+static size_t        structCount = 0;
+static size_t        structSize  = 0;
+
+/// Get the libffi type for a type code, or NULL if there is no such type.
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE
+static inline ffi_type * get_type(uint32_t code)
+{
+	if (code < CFFI_TYPE_COUNT)
+		return type_table[code];
+	if (code - CFFI_TYPE_STRUCT < structCount)
+		return &structs[code - CFFI_TYPE_STRUCT]->type;
+	return NULL;
+}
+
+/// Check if a cell is a valid type code.
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE
+static inline bool is_type(funge_cell c)
+{
+	return c >= 0 && c < CFFI_TYPE_STRUCT + (funge_cell)structCount
+	       && get_type((uint32_t)c);
+}
+
+/// Pop a type code, NULL (and code unchanged) if it isn't a valid value type.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static inline ffi_type * pop_type(instructionPointer * restrict ip, uint32_t * restrict code)
+{
+	funge_cell c = stack_pop(ip->stack);
+	if (!is_type(c) || c == CFFI_TYPE_VOID)
+		return NULL;
+	*code = (uint32_t)c;
+	return get_type(*code);
+}
+
+/// Half of a double in the order FPDP uses.
+typedef struct s_doubleHalves {
+	int32_t high;
+	int32_t low;
+} doubleHalves;
+
+/// Check if values of a type code take exactly one cell.
+FUNGE_ATTR_FAST FUNGE_ATTR_CONST
+static inline bool is_cell_type(uint32_t code)
+{
+	switch (code) {
+		case CFFI_TYPE_UINT32:
+		case CFFI_TYPE_INT8:
+		case CFFI_TYPE_UINT8:
+		case CFFI_TYPE_INT16:
+		case CFFI_TYPE_UINT16:
+		case CFFI_TYPE_INT32:
+		case CFFI_TYPE_FLOAT:
+			return true;
+		case CFFI_TYPE_INT64:
+		case CFFI_TYPE_UINT64:
+			return FUNGE_CELL_BIT == 64;
+		default:
+			return false;
+	}
+}
+
+/// Read a value of a type where is_cell_type() is true as a cell.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE
+static inline funge_cell load_cell(uint32_t code, const unsigned char * restrict src)
+{
+	switch (code) {
+		case CFFI_TYPE_INT8:
+			return (int8_t)*src;
+		case CFFI_TYPE_UINT8:
+			return *src;
+		case CFFI_TYPE_INT16: {
+			int16_t v;
+			memcpy(&v, src, sizeof(v));
+			return v;
+		}
+		case CFFI_TYPE_UINT16: {
+			uint16_t v;
+			memcpy(&v, src, sizeof(v));
+			return v;
+		}
+		case CFFI_TYPE_UINT32: {
+			uint32_t v;
+			memcpy(&v, src, sizeof(v));
+			return (funge_cell)v;
+		}
+		case CFFI_TYPE_INT32:
+		case CFFI_TYPE_FLOAT: {
+			int32_t v;
+			memcpy(&v, src, sizeof(v));
+			return v;
+		}
+		default: {
+			uint64_t v;
+			memcpy(&v, src, sizeof(v));
+			return (funge_cell)v;
+		}
+	}
+}
+
+/// Store a cell as a value of a type where is_cell_type() is true.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void store_cell(uint32_t code, funge_cell value, unsigned char * restrict dest)
+{
+	switch (code) {
+		case CFFI_TYPE_INT8:
+		case CFFI_TYPE_UINT8:
+			*dest = (unsigned char)value;
+			break;
+		case CFFI_TYPE_INT16:
+		case CFFI_TYPE_UINT16: {
+			uint16_t v = (uint16_t)value;
+			memcpy(dest, &v, sizeof(v));
+			break;
+		}
+		case CFFI_TYPE_UINT32:
+		case CFFI_TYPE_INT32:
+		case CFFI_TYPE_FLOAT: {
+			uint32_t v = (uint32_t)value;
+			memcpy(dest, &v, sizeof(v));
+			break;
+		}
+		default: {
+			uint64_t v = (uint64_t)value;
+			memcpy(dest, &v, sizeof(v));
+			break;
+		}
+	}
 }
+
+FUNGE_ATTR_FAST
+void finger_CFFI_pop_value(instructionPointer * restrict ip, uint32_t code, unsigned char * restrict dest)
+{
+	if (is_cell_type(code)) {
+		store_cell(code, stack_pop(ip->stack), dest);
+		return;
+	}
+	switch (code) {
+		case CFFI_TYPE_POINTER: {
+			void * p = popp(ip);
+			memcpy(dest, &p, sizeof(p));
+			break;
+		}
+		case CFFI_TYPE_INT64:
+		case CFFI_TYPE_UINT64: {
+			// Only with 32-bit cells.
+			uint64_t v = (uint32_t)stack_pop(ip->stack);
+			v |= (uint64_t)(uint32_t)stack_pop(ip->stack) << 32;
+			memcpy(dest, &v, sizeof(v));
+			break;
+		}
+		case CFFI_TYPE_DOUBLE: {
+			doubleHalves v;
+			v.low = (int32_t)stack_pop(ip->stack);
+			v.high = (int32_t)stack_pop(ip->stack);
+			memcpy(dest, &v, sizeof(v));
+			break;
+		}
+		default: {
+			const cffiStruct * s = structs[code - CFFI_TYPE_STRUCT];
+			for (size_t i = 0; i < s->count; i++)
+				finger_CFFI_pop_value(ip, s->codes[i], dest + s->offsets[i]);
+			break;
+		}
+	}
+}
+
+FUNGE_ATTR_FAST
+void finger_CFFI_push_value(instructionPointer * restrict ip, uint32_t code, const unsigned char * restrict src)
+{
+	if (is_cell_type(code)) {
+		stack_push(ip->stack, load_cell(code, src));
+		return;
+	}
+	switch (code) {
+		case CFFI_TYPE_POINTER: {
+			void * p;
+			memcpy(&p, src, sizeof(p));
+			pushp(ip, p);
+			break;
+		}
+		case CFFI_TYPE_INT64:
+		case CFFI_TYPE_UINT64: {
+			uint64_t v;
+			memcpy(&v, src, sizeof(v));
+			stack_push(ip->stack, (funge_cell)(uint32_t)(v >> 32));
+			stack_push(ip->stack, (funge_cell)(uint32_t)v);
+			break;
+		}
+		case CFFI_TYPE_DOUBLE: {
+			doubleHalves v;
+			memcpy(&v, src, sizeof(v));
+			stack_push(ip->stack, v.high);
+			stack_push(ip->stack, v.low);
+			break;
+		}
+		default: {
+			const cffiStruct * s = structs[code - CFFI_TYPE_STRUCT];
+			for (size_t i = s->count; i-- > 0;)
+				finger_CFFI_push_value(ip, s->codes[i], src + s->offsets[i]);
+			break;
+		}
+	}
+}
+
+/// Scratch buffer of cells for bulk transfers. Grows, never shrinks.
+static funge_cell * cell_buffer = NULL;
+static size_t       cell_buffer_size = 0;
+
+/// Get cell_buffer with room for at least count cells, NULL if out of memory.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static funge_cell * get_cell_buffer(size_t count)
+{
+	// Empty arrays must still get a buffer.
+	if (count == 0)
+		count = 1;
+	if (count > cell_buffer_size) {
+		funge_cell * newBuffer;
+		if (count > SIZE_MAX / sizeof(funge_cell))
+			return NULL;
+		newBuffer = realloc(cell_buffer, count * sizeof(funge_cell));
+		if (FUNGE_UNLIKELY(!newBuffer))
+			return NULL;
+		cell_buffer = newBuffer;
+		cell_buffer_size = count;
+	}
+	return cell_buffer;
+}
+
+FUNGE_ATTR_FAST bool finger_CFFI_is_cell_type(uint32_t code)
+{
+	return is_cell_type(code);
+}
+
+FUNGE_ATTR_FAST funge_cell finger_CFFI_load_cell(uint32_t code, const unsigned char * restrict src)
+{
+	return load_cell(code, src);
+}
+
+FUNGE_ATTR_FAST void finger_CFFI_store_cell(uint32_t code, funge_cell value, unsigned char * restrict dest)
+{
+	store_cell(code, value, dest);
+}
+
+FUNGE_ATTR_FAST funge_cell * finger_CFFI_get_cell_buffer(size_t count)
+{
+	return get_cell_buffer(count);
+}
+
+/// Round offset up to a multiple of alignment.
+#define CFFI_ALIGN(m_offset, m_alignment) \
+	(((m_offset) + (m_alignment) - 1) / (m_alignment) * (m_alignment))
+
+/* N - declare struct */
+static void finger_CFFI_declare_struct(instructionPointer * ip)
+{
+	funge_cell n = stack_pop(ip->stack);
+	uint32_t * codes;
+	size_t offset = 0, alignment = 1;
+	cffiStruct * s;
+
+	if (n <= 0 || n > CFFI_MAX_ARGS) {
+		ip_reverse(ip);
+		return;
+	}
+	codes = alloca((size_t)n * sizeof(uint32_t));
+	for (funge_cell i = 0; i < n; i++) {
+		if (!pop_type(ip, &codes[i])) {
+			ip_reverse(ip);
+			return;
+		}
+	}
+	// The same layout gets the same code.
+	for (size_t i = 0; i < structCount; i++) {
+		if (structs[i]->count == (size_t)n
+		    && memcmp(structs[i]->codes, codes, (size_t)n * sizeof(uint32_t)) == 0) {
+			stack_push(ip->stack, (funge_cell)(CFFI_TYPE_STRUCT + i));
+			return;
+		}
+	}
+
+	if (structCount == structSize) {
+		size_t newSize = structSize ? structSize * 2 : 8;
+		cffiStruct ** newStructs = realloc(structs, newSize * sizeof(cffiStruct*));
+		if (FUNGE_UNLIKELY(!newStructs)) {
+			ip_reverse(ip);
+			return;
+		}
+		structs = newStructs;
+		structSize = newSize;
+	}
+	s = malloc(sizeof(cffiStruct) + ((size_t)n + 1) * sizeof(ffi_type*)
+	           + (size_t)n * (sizeof(size_t) + sizeof(uint32_t)));
+	if (FUNGE_UNLIKELY(!s)) {
+		ip_reverse(ip);
+		return;
+	}
+	s->count = (size_t)n;
+	s->offsets = (size_t*)(s->elements + n + 1);
+	s->codes = (uint32_t*)(s->offsets + n);
+	memcpy(s->codes, codes, (size_t)n * sizeof(uint32_t));
+	// Same rules as libffi (and C) use.
+	for (funge_cell i = 0; i < n; i++) {
+		ffi_type * type = get_type(codes[i]);
+		s->elements[i] = type;
+		offset = CFFI_ALIGN(offset, type->alignment);
+		s->offsets[i] = offset;
+		offset += type->size;
+		if (type->alignment > alignment)
+			alignment = type->alignment;
+	}
+	s->elements[n] = NULL;
+	s->type.size = CFFI_ALIGN(offset, alignment);
+	s->type.alignment = (unsigned short)alignment;
+	s->type.type = FFI_TYPE_STRUCT;
+	s->type.elements = s->elements;
+	structs[structCount] = s;
+	stack_push(ip->stack, (funge_cell)(CFFI_TYPE_STRUCT + structCount));
+	structCount++;
+}
+
+/* J - pack values */
+static void finger_CFFI_pack(instructionPointer * ip)
+{
+	uint32_t code = CFFI_TYPE_VOID;
+	ffi_type * type = pop_type(ip, &code);
+	funge_cell n = stack_pop(ip->stack);
+	unsigned char * p = popp(ip);
+	funge_cell * cells = NULL;
+
+	if (!type || n < 0 || (size_t)n > SIZE_MAX / type->size
+	    || (is_cell_type(code) && !(cells = get_cell_buffer((size_t)n)))) {
+		pushp(ip, p);
+		ip_reverse(ip);
+		return;
+	}
+	if (!p) {
+		p = malloc((size_t)n * type->size + 1);
+		if (FUNGE_UNLIKELY(!p)) {
+			pushp(ip, NULL);
+			ip_reverse(ip);
+			return;
+		}
+	}
+	if (cells) {
+		// Element 0 is on top, so it is last in cells.
+		stack_pop_cells(ip->stack, cells, (size_t)n);
+		for (size_t i = 0; i < (size_t)n; i++)
+			store_cell(code, cells[(size_t)n - 1 - i], p + i * type->size);
+	} else {
+		for (size_t i = 0; i < (size_t)n; i++)
+			finger_CFFI_pop_value(ip, code, p + i * type->size);
+	}
+	pushp(ip, p);
+}
+
+/* K - unpack values */
+static void finger_CFFI_unpack(instructionPointer * ip)
+{
+	uint32_t code = CFFI_TYPE_VOID;
+	ffi_type * type = pop_type(ip, &code);
+	funge_cell n = stack_pop(ip->stack);
+	const unsigned char * p = peekp(ip);
+	funge_cell * cells = NULL;
+
+	if (!type || n < 0 || !p
+	    || (is_cell_type(code) && !(cells = get_cell_buffer((size_t)n)))) {
+		ip_reverse(ip);
+		return;
+	}
+	// Element 0 ends up on top.
+	if (cells) {
+		for (size_t i = 0; i < (size_t)n; i++)
+			cells[(size_t)n - 1 - i] = load_cell(code, p + i * type->size);
+		stack_push_cells(ip->stack, cells, (size_t)n);
+	} else {
+		for (size_t i = (size_t)n; i-- > 0;)
+			finger_CFFI_push_value(ip, code, p + i * type->size);
+	}
+}
+
+/**
+ * Pop the arguments of Q and R: a vector (relative to the storage offset),
+ * a size and a type code where is_cell_type() is true.
+ * @return False if invalid.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool pop_rect(instructionPointer * restrict ip, funge_vector * restrict pos,
+                     funge_vector * restrict size, uint32_t * restrict code,
+                     size_t * restrict elementSize)
+{
+	ffi_type * type = pop_type(ip, code);
+	*size = stack_pop_vector(ip->stack);
+	*pos = stack_pop_vector(ip->stack);
+	pos->x += ip->storageOffset.x;
+	pos->y += ip->storageOffset.y;
+	if (!type || !is_cell_type(*code) || size->x < 0 || size->y < 0)
+		return false;
+	*elementSize = type->size;
+	return (size_t)size->x <= SIZE_MAX / type->size / ((size_t)size->y + 1);
+}
+
+/* Q - copy Funge-Space to native memory */
+static void finger_CFFI_from_fungespace(instructionPointer * ip)
+{
+	funge_vector pos, size;
+	uint32_t code = CFFI_TYPE_VOID;
+	size_t elementSize;
+	unsigned char * p = popp(ip);
+	funge_cell * cells;
+
+	if (!pop_rect(ip, &pos, &size, &code, &elementSize)
+	    || !(cells = get_cell_buffer((size_t)size.x))) {
+		pushp(ip, p);
+		ip_reverse(ip);
+		return;
+	}
+	if (!p) {
+		p = malloc((size_t)size.x * (size_t)size.y * elementSize + 1);
+		if (FUNGE_UNLIKELY(!p)) {
+			pushp(ip, NULL);
+			ip_reverse(ip);
+			return;
+		}
+	}
+	for (funge_cell y = 0; y < size.y; y++) {
+		unsigned char * row = p + (size_t)y * (size_t)size.x * elementSize;
+		funge_vector rowPos = { .x = pos.x, .y = pos.y + y };
+		fungespace_get_cells(cells, (size_t)size.x, &rowPos);
+		for (size_t x = 0; x < (size_t)size.x; x++)
+			store_cell(code, cells[x], row + x * elementSize);
+	}
+	pushp(ip, p);
+}
+
+/* R - copy native memory to Funge-Space */
+static void finger_CFFI_to_fungespace(instructionPointer * ip)
+{
+	funge_vector pos, size;
+	uint32_t code = CFFI_TYPE_VOID;
+	size_t elementSize;
+	const unsigned char * p = peekp(ip);
+	funge_cell * cells;
+
+	if (!pop_rect(ip, &pos, &size, &code, &elementSize) || !p
+	    || !(cells = get_cell_buffer((size_t)size.x))) {
+		ip_reverse(ip);
+		return;
+	}
+	for (funge_cell y = 0; y < size.y; y++) {
+		const unsigned char * row = p + (size_t)y * (size_t)size.x * elementSize;
+		funge_vector rowPos = { .x = pos.x, .y = pos.y + y };
+		for (size_t x = 0; x < (size_t)size.x; x++)
+			cells[x] = load_cell(code, row + x * elementSize);
+		fungespace_set_cells(cells, (size_t)size.x, &rowPos);
+	}
+}
+
+/* V - attach native memory to Funge-Space */
+static void finger_CFFI_attach(instructionPointer * ip)
+{
+	funge_vector pos, size;
+	uint32_t code = CFFI_TYPE_VOID;
+	size_t elementSize;
+	void * p = peekp(ip);
+	fungeRect rect;
+
+	if (!pop_rect(ip, &pos, &size, &code, &elementSize) || !p) {
+		ip_reverse(ip);
+		return;
+	}
+	rect.x = pos.x;
+	rect.y = pos.y;
+	rect.w = size.x;
+	rect.h = size.y;
+	// Floats look like they do in FPSP, as signed 32-bit integers.
+	if (!fungespace_attach(&rect, p, elementSize,
+	                       code == CFFI_TYPE_INT8 || code == CFFI_TYPE_INT16
+	                       || code == CFFI_TYPE_INT32 || code == CFFI_TYPE_INT64
+	                       || code == CFFI_TYPE_FLOAT))
+		ip_reverse(ip);
+}
+
+/* Z - detach native memory from Funge-Space */
+static void finger_CFFI_detach(instructionPointer * ip)
+{
+	funge_vector pos = stack_pop_vector(ip->stack);
+	pos.x += ip->storageOffset.x;
+	pos.y += ip->storageOffset.y;
+	if (!fungespace_detach(&pos))
+		ip_reverse(ip);
+}
+
+/*
+ * Call interfaces. ffi_prep_cif() is slow compared to the call itself, so
+ * each distinct signature is prepared once and kept in a hash table. The
+ * signatures are never freed, so handles given out by A and H stay valid.
+ */
+
+/// Number of buckets in the signature hash table.
+#define CFFI_SIGNATURE_BUCKETS 64
+
+static cffiSignature * signatures[CFFI_SIGNATURE_BUCKETS];
+
+/**
+ * Find or prepare the signature for a list of type codes.
+ * @param codes Return type followed by nargs argument types. Only the
+ *              return type may be void.
+ * @return The signature, or NULL if a type is invalid, libffi doesn't accept
+ *         it or if out of memory.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static cffiSignature * get_signature(const uint32_t * restrict codes, unsigned int nargs)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261U;
+	cffiSignature * sig;
+	ffi_type * rtype;
+	size_t offset = 0;
+
+	for (unsigned int i = 0; i <= nargs; i++) {
+		hash ^= codes[i];
+		hash *= 16777619U;
+	}
+	for (sig = signatures[hash % CFFI_SIGNATURE_BUCKETS]; sig; sig = sig->next) {
+		if (sig->nargs == nargs && memcmp(sig->codes, codes, (nargs + 1) * sizeof(uint32_t)) == 0)
+			return sig;
+	}
+
+	rtype = get_type(codes[0]);
+	if (!rtype)
+		return NULL;
+	sig = malloc(sizeof(cffiSignature) + nargs * (sizeof(ffi_type*) + sizeof(size_t))
+	             + (nargs + 1) * sizeof(uint32_t));
+	if (FUNGE_UNLIKELY(!sig))
+		return NULL;
+	sig->nargs = nargs;
+	sig->offsets = (size_t*)(sig->argtypes + nargs);
+	sig->codes = (uint32_t*)(sig->offsets + nargs);
+	memcpy(sig->codes, codes, (nargs + 1) * sizeof(uint32_t));
+	for (unsigned int i = 0; i < nargs; i++) {
+		ffi_type * type = get_type(codes[i + 1]);
+		if (!type || codes[i + 1] == CFFI_TYPE_VOID) {
+			free(sig);
+			return NULL;
+		}
+		sig->argtypes[i] = type;
+		offset = CFFI_ALIGN(offset, type->alignment);
+		sig->offsets[i] = offset;
+		offset += type->size;
+	}
+	sig->argsSize = offset;
+	// libffi widens small integer return values to ffi_arg.
+	sig->returnSize = rtype->size > sizeof(ffi_arg) ? rtype->size : sizeof(ffi_arg);
+	if (ffi_prep_cif(&sig->cif, FFI_DEFAULT_ABI, nargs, rtype, sig->argtypes) != FFI_OK) {
+		free(sig);
+		return NULL;
+	}
+	sig->next = signatures[hash % CFFI_SIGNATURE_BUCKETS];
+	signatures[hash % CFFI_SIGNATURE_BUCKETS] = sig;
+	return sig;
+}
+
+/**
+ * Pop a signature: return type (0 = uint32, 1 = pointer, anything else =
+ * void), number of arguments and then the bitmask cells, where a set bit
+ * means the argument is a pointer.
+ * @return The signature, or NULL if it is invalid.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static cffiSignature * pop_signature(instructionPointer * restrict ip)
+{
+	funge_cell ret = stack_pop(ip->stack);
+	funge_cell len = stack_pop(ip->stack);
+	uint32_t * codes;
+	unsigned int count = 0;
+
+	if (len < 0 || len > CFFI_MAX_ARGS)
+		return NULL;
+	codes = alloca(((size_t)len + 1) * sizeof(uint32_t));
+	switch (ret) {
+		case 0:
+			codes[0] = CFFI_TYPE_UINT32;
+			break;
+		case 1:
+			codes[0] = CFFI_TYPE_POINTER;
+			break;
+		default:
+			codes[0] = CFFI_TYPE_VOID;
+			break;
+	}
+	while (count < (unsigned int)len) {
+		// Part of the bitmask, if there are more arguments than bits in a cell.
+		funge_unsigned_cell cur = (funge_unsigned_cell)stack_pop(ip->stack);
+		for (size_t i = 0; (i < sizeof(funge_cell) * 8) && (count < (unsigned int)len); i++) {
+			codes[++count] = (cur & 1) ? CFFI_TYPE_POINTER : CFFI_TYPE_UINT32;
+			cur >>= 1;
+		}
+	}
+	return get_signature(codes, (unsigned int)len);
+}
+
+instructionPointer * finger_CFFI_caller = NULL;
+
+FUNGE_ATTR_FAST void finger_CFFI_push_result(instructionPointer * restrict ip,
+                                             const cffiSignature * restrict sig,
+                                             const unsigned char * restrict result)
+{
+	// libffi widens small integer return values to ffi_arg.
+	switch (sig->codes[0]) {
+		case CFFI_TYPE_VOID:
+			break;
+		case CFFI_TYPE_INT8:
+		case CFFI_TYPE_INT16:
+		case CFFI_TYPE_INT32: {
+			ffi_sarg v;
+			memcpy(&v, result, sizeof(v));
+			stack_push(ip->stack, (funge_cell)v);
+			break;
+		}
+		case CFFI_TYPE_UINT8:
+		case CFFI_TYPE_UINT16:
+		case CFFI_TYPE_UINT32: {
+			ffi_arg v;
+			memcpy(&v, result, sizeof(v));
+			stack_push(ip->stack, (funge_cell)v);
+			break;
+		}
+		default:
+			finger_CFFI_push_value(ip, sig->codes[0], result);
+			break;
+	}
+}
+
+FUNGE_ATTR_FAST void finger_CFFI_pop_result(instructionPointer * restrict ip,
+                                            const cffiSignature * restrict sig,
+                                            unsigned char * restrict result)
+{
+	ffi_sarg sv;
+	ffi_arg uv;
+
+	switch (sig->codes[0]) {
+		case CFFI_TYPE_VOID:
+			return;
+		case CFFI_TYPE_INT8:
+			sv = (int8_t)stack_pop(ip->stack);
+			break;
+		case CFFI_TYPE_INT16:
+			sv = (int16_t)stack_pop(ip->stack);
+			break;
+		case CFFI_TYPE_INT32:
+			sv = (int32_t)stack_pop(ip->stack);
+			break;
+		case CFFI_TYPE_UINT8:
+			uv = (uint8_t)stack_pop(ip->stack);
+			memcpy(result, &uv, sizeof(uv));
+			return;
+		case CFFI_TYPE_UINT16:
+			uv = (uint16_t)stack_pop(ip->stack);
+			memcpy(result, &uv, sizeof(uv));
+			return;
+		case CFFI_TYPE_UINT32:
+			uv = (uint32_t)stack_pop(ip->stack);
+			memcpy(result, &uv, sizeof(uv));
+			return;
+		default:
+			finger_CFFI_pop_value(ip, sig->codes[0], result);
+			return;
+	}
+	memcpy(result, &sv, sizeof(sv));
+}
+
+/**
+ * Pop the arguments for sig and then the function from the pointer stack,
+ * call it and push the return value.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void call_signature(instructionPointer * restrict ip, cffiSignature * restrict sig)
+{
+	unsigned char * args = alloca(sig->argsSize + 1);
+	void ** arguments = alloca((sig->nargs + 1) * sizeof(void*));
+	unsigned char * result = alloca(sig->returnSize);
+	instructionPointer * caller;
+	void * func;
+
+	for (unsigned int i = 0; i < sig->nargs; i++) {
+		arguments[i] = args + sig->offsets[i];
+		finger_CFFI_pop_value(ip, sig->codes[i + 1], arguments[i]);
+	}
+	func = popp(ip);
+	if (FUNGE_UNLIKELY(!func)) {
+		ip_reverse(ip);
+		return;
+	}
+
+	// Calls can nest through callbacks.
+	caller = finger_CFFI_caller;
+	finger_CFFI_caller = ip;
+	ffi_call(&sig->cif, (void (*)(void))(uintptr_t)func, result, arguments);
+	finger_CFFI_end_call(ip, caller);
+
+	finger_CFFI_push_result(ip, sig, result);
+}
+
+/* A - prepare signature */
+static void finger_CFFI_prepare(instructionPointer * ip)
+{
+	cffiSignature * sig = pop_signature(ip);
+	if (FUNGE_UNLIKELY(!sig)) {
+		ip_reverse(ip);
+		return;
+	}
+	pushp(ip, sig);
+}
+
+/* H - prepare typed signature */
+static void finger_CFFI_prepare_typed(instructionPointer * ip)
+{
+	funge_cell ret = stack_pop(ip->stack);
+	funge_cell len = stack_pop(ip->stack);
+	uint32_t * codes;
+	cffiSignature * sig;
+
+	if (len < 0 || len > CFFI_MAX_ARGS || !is_type(ret)) {
+		ip_reverse(ip);
+		return;
+	}
+	codes = alloca(((size_t)len + 1) * sizeof(uint32_t));
+	codes[0] = (uint32_t)ret;
+	for (funge_cell i = 1; i <= len; i++) {
+		funge_cell c = stack_pop(ip->stack);
+		// Invalid codes are caught by get_signature().
+		codes[i] = is_type(c) ? (uint32_t)c : CFFI_TYPE_VOID;
+	}
+	sig = get_signature(codes, (unsigned int)len);
+	if (FUNGE_UNLIKELY(!sig)) {
+		ip_reverse(ip);
+		return;
+	}
+	pushp(ip, sig);
+}
+
+/* C - call */
+static void finger_CFFI_ccall(instructionPointer * ip)
+{
+	cffiSignature * sig = pop_signature(ip);
+	if (FUNGE_UNLIKELY(!sig)) {
+		ip_reverse(ip);
+		return;
+	}
+	call_signature(ip, sig);
+}
+
+/* E - call with prepared signature */
+static void finger_CFFI_call_prepared(instructionPointer * ip)
+{
+	cffiSignature * sig = popp(ip);
+	if (FUNGE_UNLIKELY(!sig)) {
+		ip_reverse(ip);
+		return;
+	}
+	call_signature(ip, sig);
+}
+
+FUNGE_ATTR_FAST bool finger_CFFI_duplicate_ip(const instructionPointer * restrict oldip,
+                                              instructionPointer * restrict newip)
+{
+	const cffiState * old = oldip->fingerCFFIstate;
+	cffiState * state;
+
+	newip->fingerCFFIstate = NULL;
+	if (!old)
+		return true;
+	state = malloc(sizeof(cffiState));
+	if (FUNGE_UNLIKELY(!state))
+		return false;
+	state->pointers = malloc(old->size * sizeof(void*));
+	if (FUNGE_UNLIKELY(!state->pointers)) {
+		free(state);
+		return false;
+	}
+	memcpy(state->pointers, old->pointers, old->top * sizeof(void*));
+	state->top = old->top;
+	state->size = old->size;
+	// Temporary strings belong to the calls of the parent.
+	state->arena = NULL;
+	newip->fingerCFFIstate = state;
+	return true;
+}
+
+FUNGE_ATTR_FAST void finger_CFFI_free_ip(instructionPointer * restrict ip)
+{
+	cffiArena * block;
+
+	if (!ip->fingerCFFIstate)
+		return;
+	block = ip->fingerCFFIstate->arena;
+	while (block) {
+		cffiArena * next = block->next;
+		free(block);
+		block = next;
+	}
+	free(ip->fingerCFFIstate->pointers);
+	free(ip->fingerCFFIstate);
+	ip->fingerCFFIstate = NULL;
+}
+
 bool finger_CFFI_load(instructionPointer * ip)
 {
+	cffiState * state = ip->fingerCFFIstate;
+	if (!state) {
+		state = malloc(sizeof(cffiState));
+		if (FUNGE_UNLIKELY(!state))
+			return false;
+		state->pointers = malloc(CFFI_PSTACK_INITIAL * sizeof(void*));
+		if (FUNGE_UNLIKELY(!state->pointers)) {
+			free(state);
+			return false;
+		}
+		state->size = CFFI_PSTACK_INITIAL;
+		state->arena = NULL;
+		ip->fingerCFFIstate = state;
+	}
+	manager_add_opcode(CFFI, 'A', prepare);
 	manager_add_opcode(CFFI, 'B', getbyte);
 	manager_add_opcode(CFFI, 'C', ccall);
 	manager_add_opcode(CFFI, 'D', duplicate);
+	manager_add_opcode(CFFI, 'E', call_prepared);
 	manager_add_opcode(CFFI, 'F', free);
 	manager_add_opcode(CFFI, 'G', pointer_to_funge);
+	manager_add_opcode(CFFI, 'H', prepare_typed);
 	manager_add_opcode(CFFI, 'I', popp);
+	manager_add_opcode(CFFI, 'J', pack);
+	manager_add_opcode(CFFI, 'K', unpack);
 	manager_add_opcode(CFFI, 'L', dlopen);
 	manager_add_opcode(CFFI, 'M', malloc);
+	manager_add_opcode(CFFI, 'N', declare_struct);
 	manager_add_opcode(CFFI, 'O', print_pstack);
 	manager_add_opcode(CFFI, 'P', funge_to_pointer);
+	manager_add_opcode(CFFI, 'Q', from_fungespace);
+	manager_add_opcode(CFFI, 'R', to_fungespace);
 	manager_add_opcode(CFFI, 'S', generate_string);
 	manager_add_opcode(CFFI, 'T', dlsym);
 	manager_add_opcode(CFFI, 'U', dlclose);
+	manager_add_opcode(CFFI, 'V', attach);
 	manager_add_opcode(CFFI, 'W', dereference);
 	manager_add_opcode(CFFI, 'X', write_to_arr);
 	manager_add_opcode(CFFI, 'Y', swap);
-	if (pstack!=NULL){
-		free(pstack);
-	}
-	pstack=malloc(sizeof(void*));
-	*pstack=NULL;
-	stack_ptr=1;
+	manager_add_opcode(CFFI, 'Z', detach);
+	// Loading starts with a single NULL on the pointer stack.
+	state->pointers[0] = NULL;
+	state->top = 1;
 	return true;
 }
@@ -27,4 +27,138 @@
 
 bool finger_CFFI_load(instructionPointer * ip);
 
+/**
+ * Give a new IP (from t) a copy of the pointer stack of its parent.
+ * @return False if out of memory.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool finger_CFFI_duplicate_ip(const instructionPointer * restrict oldip,
+                              instructionPointer * restrict newip);
+
+/// Free the pointer stack of an IP.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void finger_CFFI_free_ip(instructionPointer * restrict ip);
+
+/**
+ * Load a library and look up a symbol in it for the -L option, so programs
+ * can get it by number with CFFX G. The first call gets number 0.
+ * @param spec "library:symbol", with an empty library for the program itself.
+ * @return False if the library or symbol can't be found.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool finger_CFFI_preload(const char * spec);
+
+// Used by other fingerprints building on CFFI, like CFFX.
+#ifdef FUNGE_EXTENDS_CFFI
+#include <ffi.h>
+#include <stdint.h>
+
+/// Type codes of the basic types.
+enum {
+	CFFI_TYPE_UINT32  = 0,
+	CFFI_TYPE_POINTER = 1,
+	CFFI_TYPE_VOID    = 2,
+	CFFI_TYPE_INT8    = 3,
+	CFFI_TYPE_UINT8   = 4,
+	CFFI_TYPE_INT16   = 5,
+	CFFI_TYPE_UINT16  = 6,
+	CFFI_TYPE_INT32   = 7,
+	CFFI_TYPE_INT64   = 8,
+	CFFI_TYPE_UINT64  = 9,
+	CFFI_TYPE_FLOAT   = 10,
+	CFFI_TYPE_DOUBLE  = 11,
+	CFFI_TYPE_COUNT,
+	/// Code of the first declared struct.
+	CFFI_TYPE_STRUCT  = 16
+};
+
+/// A prepared call interface.
+typedef struct s_cffiSignature {
+	struct s_cffiSignature * next;       ///< Next signature in the same bucket.
+	ffi_cif                  cif;
+	unsigned int             nargs;
+	size_t                   argsSize;   ///< Size of buffer for all arguments.
+	size_t                   returnSize; ///< Size of buffer for return value.
+	uint32_t               * codes;      ///< Return type, then argument types.
+	size_t                 * offsets;    ///< Offsets of arguments in buffer.
+	ffi_type               * argtypes[]; ///< Followed by offsets and codes.
+} cffiSignature;
+
+/// The IP making the innermost call through libffi, NULL outside calls.
+extern instructionPointer * finger_CFFI_caller;
+
+/// Get the symbol number id from -L.
+/// @return False if there is no such symbol.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool finger_CFFI_get_preloaded(funge_cell id, void ** address);
+
+/// Pop a pointer from the pointer stack of ip. NULL if it is empty.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void * finger_CFFI_pop_pointer(instructionPointer * restrict ip);
+
+/// Push a pointer to the pointer stack of ip.
+FUNGE_ATTR_FAST
+void finger_CFFI_push_pointer(instructionPointer * restrict ip, void * p);
+
+/**
+ * Get size bytes of temporary memory for strings passed to calls. It is
+ * freed when the outermost call made by ip returns.
+ * @return The memory, NULL if out of memory.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+unsigned char * finger_CFFI_temporary(instructionPointer * restrict ip, size_t size);
+
+/**
+ * Finish a call made by ip: restore finger_CFFI_caller to caller (its value
+ * before the call) and, after the outermost call, free the temporary memory.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR((nonnull(1)))
+void finger_CFFI_end_call(instructionPointer * restrict ip, instructionPointer * caller);
+
+/// Check if values of a type take exactly one cell.
+FUNGE_ATTR_FAST FUNGE_ATTR_CONST FUNGE_ATTR_WARN_UNUSED
+bool finger_CFFI_is_cell_type(uint32_t code);
+
+/// Read a value of a type that takes one cell as a cell.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+funge_cell finger_CFFI_load_cell(uint32_t code, const unsigned char * restrict src);
+
+/// Store a cell as a value of a type that takes one cell, truncating it.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void finger_CFFI_store_cell(uint32_t code, funge_cell value, unsigned char * restrict dest);
+
+/// Get a scratch buffer of at least count cells, shared with CFFI Q and R.
+/// @return The buffer, NULL if out of memory.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+funge_cell * finger_CFFI_get_cell_buffer(size_t count);
+
+/**
+ * Pop a value of the given type from the stack (and pointer stack) and
+ * store it at dest. 64-bit integers take two cells (high low, like G) if
+ * cells are 32-bit, floats and doubles are stored like in FPSP and FPDP, and
+ * structs are popped member by member, first member on top.
+ * @param code A valid type code other than void.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void finger_CFFI_pop_value(instructionPointer * restrict ip, uint32_t code, unsigned char * restrict dest);
+
+/// Push the value of the given type at src, the reverse of finger_CFFI_pop_value().
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void finger_CFFI_push_value(instructionPointer * restrict ip, uint32_t code, const unsigned char * restrict src);
+
+/// Push the return value of a call with sig from the buffer libffi wrote it to.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void finger_CFFI_push_result(instructionPointer * restrict ip,
+                             const cffiSignature * restrict sig,
+                             const unsigned char * restrict result);
+
+/// Pop a return value for sig into a buffer for libffi, the reverse of
+/// finger_CFFI_push_result(). Small integers are widened like libffi wants.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void finger_CFFI_pop_result(instructionPointer * restrict ip,
+                            const cffiSignature * restrict sig,
+                            unsigned char * restrict result);
+
+#endif
+
 #endif
@@ -0,0 +1,18 @@
+%fingerprint-spec 1.4
+%fprint:CFFX
+%url:doc/CFFX.txt
+%desc:Callbacks and more for CFFI
+%safe:false
+%begin-instrs
+#I	name	desc
+B	bind	Make a C function pointer that runs a Funge subroutine
+G	get_preloaded	Get a symbol loaded with the -L option
+M	map	Call a function for many argument tuples
+O	call_async	Call a function on a worker thread
+P	poll	Check if a call made by O is done
+U	unbind	Free a function pointer made by B
+V	row_string	Copy a row of Funge-Space to a temporary C string
+W	wait	Wait for a call made by O and get the return value
+X	return	Return from a subroutine called from C
+Z	stack_string	Pop a 0gnirts as a temporary C string
+%end
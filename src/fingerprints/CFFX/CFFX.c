@@ -0,0 +1,783 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CFFX.h"
+#include "../../interpreter.h"
+#include "../../ioloop.h"
+#include "../../settings.h"
+#include "../../stack.h"
+
+#define FUNGE_EXTENDS_CFFI
+#include "../CFFI/CFFI.h"
+
+#include <alloca.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>  /* memset */
+#include <unistd.h>  /* pipe, write, close */
+
+/*
+ * Callbacks. A callback is a libffi closure: C calls it like any function,
+ * and it runs a Funge subroutine on the IP that made the CFFI call C is
+ * running in. The entry works like SUBR C and the return like SUBR R, except
+ * that the arguments and the return value are converted like for a call.
+ */
+
+/// A callback made by B.
+typedef struct s_cffxCallback {
+	struct s_cffxCallback * next;
+	ffi_closure           * closure;
+	void                  * code;    ///< What C calls.
+	cffiSignature         * sig;
+	funge_vector            entry;   ///< Absolute position of the subroutine.
+	size_t                  running; ///< Number of calls in progress.
+} cffxCallback;
+
+/// A running callback, waiting for R.
+typedef struct s_cffxFrame {
+	struct s_cffxFrame  * prev;
+	instructionPointer  * ip;
+	const cffiSignature * sig;
+	unsigned char       * result;
+	bool                  done;
+} cffxFrame;
+
+static cffxCallback * callbacks = NULL;
+/// The innermost running callback.
+static cffxFrame    * frames    = NULL;
+
+static const funge_vector CFFXnewDelta = { .x = 1, .y = 0 };
+
+/// The thread running the interpreter. Callbacks can't run on other threads.
+static pthread_t interpreter_thread;
+
+/// Called by libffi when C calls a callback.
+static void run_callback(ffi_cif * cif, void * result, void ** args, void * data)
+{
+	cffxCallback * cb = data;
+	instructionPointer * ip;
+	cffxFrame frame;
+
+	(void)cif;
+	// Small integers are returned widened to ffi_arg.
+	switch (cb->sig->codes[0]) {
+		case CFFI_TYPE_VOID:
+			break;
+		case CFFI_TYPE_INT8:
+		case CFFI_TYPE_UINT8:
+		case CFFI_TYPE_INT16:
+		case CFFI_TYPE_UINT16:
+		case CFFI_TYPE_INT32:
+		case CFFI_TYPE_UINT32:
+			memset(result, 0, sizeof(ffi_arg));
+			break;
+		default:
+			memset(result, 0, cb->sig->cif.rtype->size);
+			break;
+	}
+	// In an O call there is no IP to run it on. Check that first: only the
+	// interpreter thread may read finger_CFFI_caller.
+	if (!pthread_equal(pthread_self(), interpreter_thread))
+		return;
+	// Nor outside a CFFI call.
+	ip = finger_CFFI_caller;
+	if (FUNGE_UNLIKELY(!ip))
+		return;
+
+	stack_push_vector(ip->stack, &ip->position);
+	stack_push_vector(ip->stack, &ip->delta);
+	for (unsigned int i = cb->sig->nargs; i-- > 0;)
+		finger_CFFI_push_value(ip, cb->sig->codes[i + 1], args[i]);
+	ip_set_position(ip, &cb->entry);
+	ip->delta = CFFXnewDelta;
+
+	frame.prev = frames;
+	frame.ip = ip;
+	frame.sig = cb->sig;
+	frame.result = result;
+	frame.done = false;
+	frames = &frame;
+	cb->running++;
+	interpreter_run_nested(ip, &frame.done);
+	cb->running--;
+	frames = frame.prev;
+}
+
+/// B - Bind a subroutine to a callback
+static void finger_CFFX_bind(instructionPointer * ip)
+{
+	cffxCallback * cb;
+	cffiSignature * sig;
+	funge_vector entry = stack_pop_vector(ip->stack);
+
+	entry.x += ip->storageOffset.x;
+	entry.y += ip->storageOffset.y;
+	sig = finger_CFFI_pop_pointer(ip);
+	if (FUNGE_UNLIKELY(!sig))
+		goto error;
+	cb = malloc(sizeof(cffxCallback));
+	if (FUNGE_UNLIKELY(!cb))
+		goto error;
+	cb->closure = ffi_closure_alloc(sizeof(ffi_closure), &cb->code);
+	if (FUNGE_UNLIKELY(!cb->closure)) {
+		free(cb);
+		goto error;
+	}
+	if (ffi_prep_closure_loc(cb->closure, &sig->cif, &run_callback, cb, cb->code) != FFI_OK) {
+		ffi_closure_free(cb->closure);
+		free(cb);
+		goto error;
+	}
+	cb->sig = sig;
+	cb->entry = entry;
+	cb->running = 0;
+	cb->next = callbacks;
+	callbacks = cb;
+	finger_CFFI_push_pointer(ip, cb->code);
+	return;
+error:
+	ip_reverse(ip);
+}
+
+/// U - Unbind and free a callback
+static void finger_CFFX_unbind(instructionPointer * ip)
+{
+	void * code = finger_CFFI_pop_pointer(ip);
+	cffxCallback ** prev = &callbacks;
+
+	while (*prev && (*prev)->code != code)
+		prev = &(*prev)->next;
+	if (!*prev || (*prev)->running != 0) {
+		ip_reverse(ip);
+	} else {
+		cffxCallback * cb = *prev;
+		*prev = cb->next;
+		ffi_closure_free(cb->closure);
+		free(cb);
+	}
+}
+
+/// X - Return from a callback
+static void finger_CFFX_return(instructionPointer * ip)
+{
+	cffxFrame * frame = frames;
+	funge_vector pos, delta;
+
+	if (!frame || frame->ip != ip) {
+		ip_reverse(ip);
+		return;
+	}
+	finger_CFFI_pop_result(ip, frame->sig, frame->result);
+	delta = stack_pop_vector(ip->stack);
+	pos = stack_pop_vector(ip->stack);
+	ip_set_position(ip, &pos);
+	ip->delta = delta;
+	frame->done = true;
+}
+
+/// G - Get a symbol loaded by -L
+static void finger_CFFX_get_preloaded(instructionPointer * ip)
+{
+	void * address;
+
+	if (!finger_CFFI_get_preloaded(stack_pop(ip->stack), &address)) {
+		ip_reverse(ip);
+		return;
+	}
+	finger_CFFI_push_pointer(ip, address);
+}
+
+/*
+ * Asynchronous calls. O hands the call to a pool of worker threads and gives
+ * back a ticket, a handle like the ones of SOCK. The pool grows up to
+ * CFFX_MAX_WORKERS threads as needed and the threads are kept until exit.
+ */
+
+/// Largest number of worker threads.
+#define CFFX_MAX_WORKERS 8
+
+/// Alignment of the argument and return value buffers of a job.
+#define CFFX_JOB_ALIGN 16
+
+/// Number of tickets to allocate at once.
+#define ALLOCCHUNK 8
+
+/// A call made by O.
+typedef struct s_cffxJob {
+	struct s_cffxJob * next;      ///< Next job in the queue.
+	cffiSignature    * sig;
+	void             * func;
+	void            ** arguments;
+	unsigned char    * result;
+	int                notify[2]; ///< Pipe written when done, for -N. -1 if none.
+	bool               done;      ///< Protected by pool_lock.
+} cffxJob;
+
+static pthread_mutex_t pool_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_work  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  pool_done  = PTHREAD_COND_INITIALIZER;
+static cffxJob       * queue_head = NULL;
+static cffxJob       * queue_tail = NULL;
+static size_t          queued     = 0;
+static size_t          workers    = 0;
+static size_t          idle       = 0;
+
+/// Tickets, only used by the interpreter thread.
+static cffxJob ** jobs    = NULL;
+static size_t     maxJob  = 0;
+
+static void * run_worker(void * arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		cffxJob * job;
+		while (!queue_head)
+			pthread_cond_wait(&pool_work, &pool_lock);
+		job = queue_head;
+		queue_head = job->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		queued--;
+		idle--;
+		pthread_mutex_unlock(&pool_lock);
+
+		ffi_call(&job->sig->cif, (void (*)(void))(uintptr_t)job->func, job->result, job->arguments);
+
+		pthread_mutex_lock(&pool_lock);
+		job->done = true;
+		idle++;
+		if (job->notify[1] != -1) {
+			ssize_t written;
+			do {
+				written = write(job->notify[1], "", 1);
+			} while (written == -1 && errno == EINTR);
+		}
+		pthread_cond_broadcast(&pool_done);
+	}
+	return NULL;
+}
+
+/// Queue a job, starting a worker if needed.
+/// @return False if there is no worker to run it.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool queue_job(cffxJob * job)
+{
+	bool ok = true;
+
+	pthread_mutex_lock(&pool_lock);
+	if (queued >= idle && workers < CFFX_MAX_WORKERS) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, &run_worker, NULL) == 0) {
+			workers++;
+			idle++;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	if (workers == 0) {
+		ok = false;
+	} else {
+		job->next = NULL;
+		if (queue_tail)
+			queue_tail->next = job;
+		else
+			queue_head = job;
+		queue_tail = job;
+		queued++;
+		pthread_cond_signal(&pool_work);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return ok;
+}
+
+/// Get a free ticket, -1 if out of memory.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static inline funge_cell allocate_ticket(void)
+{
+	for (size_t i = 0; i < maxJob; i++) {
+		if (jobs[i] == NULL)
+			return (funge_cell)i;
+	}
+	{
+		size_t oldMax = maxJob;
+		size_t newMax = maxJob ? maxJob * 2 : ALLOCCHUNK;
+		cffxJob ** newlist = realloc(jobs, newMax * sizeof(cffxJob*));
+		if (!newlist)
+			return -1;
+		jobs = newlist;
+		for (size_t i = oldMax; i < newMax; i++)
+			jobs[i] = NULL;
+		maxJob = newMax;
+		return (funge_cell)oldMax;
+	}
+}
+
+/// Get the job of a ticket, NULL if there is no such ticket.
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline cffxJob * lookup_ticket(funge_cell ticket)
+{
+	if (ticket < 0 || (size_t)ticket >= maxJob)
+		return NULL;
+	return jobs[ticket];
+}
+
+/// Check if a job is done.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static inline bool job_done(cffxJob * job)
+{
+	bool done;
+	pthread_mutex_lock(&pool_lock);
+	done = job->done;
+	pthread_mutex_unlock(&pool_lock);
+	return done;
+}
+
+/// O - Call in the background
+static void finger_CFFX_call_async(instructionPointer * ip)
+{
+	cffiSignature * sig = finger_CFFI_pop_pointer(ip);
+	size_t argumentsSize, argsOffset, resultOffset;
+	unsigned char * args;
+	cffxJob * job;
+	funge_cell ticket;
+
+	if (FUNGE_UNLIKELY(!sig)) {
+		ip_reverse(ip);
+		return;
+	}
+	// One allocation for the job, the argument pointers and both buffers.
+	argumentsSize = (sig->nargs + 1) * sizeof(void*);
+	argsOffset = (sizeof(cffxJob) + argumentsSize + CFFX_JOB_ALIGN - 1) / CFFX_JOB_ALIGN * CFFX_JOB_ALIGN;
+	resultOffset = (argsOffset + sig->argsSize + CFFX_JOB_ALIGN - 1) / CFFX_JOB_ALIGN * CFFX_JOB_ALIGN;
+	job = malloc(resultOffset + sig->returnSize);
+	if (FUNGE_UNLIKELY(!job)) {
+		ip_reverse(ip);
+		return;
+	}
+	job->arguments = (void**)(job + 1);
+	args = (unsigned char*)job + argsOffset;
+	job->result = (unsigned char*)job + resultOffset;
+	for (unsigned int i = 0; i < sig->nargs; i++) {
+		job->arguments[i] = args + sig->offsets[i];
+		finger_CFFI_pop_value(ip, sig->codes[i + 1], job->arguments[i]);
+	}
+	job->func = finger_CFFI_pop_pointer(ip);
+	job->sig = sig;
+	job->notify[0] = job->notify[1] = -1;
+	job->done = false;
+	ticket = allocate_ticket();
+	if (FUNGE_UNLIKELY(!job->func || ticket == -1 || !queue_job(job))) {
+		free(job);
+		ip_reverse(ip);
+		return;
+	}
+	jobs[ticket] = job;
+	stack_push(ip->stack, ticket);
+}
+
+/// P - Poll a ticket
+static void finger_CFFX_poll(instructionPointer * ip)
+{
+	cffxJob * job = lookup_ticket(stack_pop(ip->stack));
+
+	if (!job) {
+		ip_reverse(ip);
+		return;
+	}
+	stack_push(ip->stack, job_done(job));
+}
+
+/// W - Wait for a ticket and get the return value
+static void finger_CFFX_wait(instructionPointer * ip)
+{
+	funge_cell ticket = stack_peek(ip->stack);
+	cffxJob * job = lookup_ticket(ticket);
+
+	if (!job) {
+		stack_discard(ip->stack, 1);
+		ip_reverse(ip);
+		return;
+	}
+#ifdef IO_EVENT_LOOP
+	// Let the other IPs run meanwhile, like for input.
+	if (setting_io_event_loop && !ioloop_alone && !job_done(job)) {
+		bool ready;
+		pthread_mutex_lock(&pool_lock);
+		if (job->notify[0] == -1 && !job->done && pipe(job->notify) == -1)
+			job->notify[0] = job->notify[1] = -1;
+		pthread_mutex_unlock(&pool_lock);
+		// Without a pipe just block.
+		ready = job->notify[0] == -1 || ioloop_wait_readable(ip, job->notify[0]);
+		if (!ready)
+			return;
+	}
+#endif
+	stack_discard(ip->stack, 1);
+	pthread_mutex_lock(&pool_lock);
+	while (!job->done)
+		pthread_cond_wait(&pool_done, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+
+	if (job->notify[0] != -1) {
+		ioloop_fd_closing(job->notify[0]);
+		close(job->notify[0]);
+		close(job->notify[1]);
+	}
+	jobs[ticket] = NULL;
+	finger_CFFI_push_result(ip, job->sig, job->result);
+	free(job);
+}
+
+/*
+ * Map calls. M calls a function once for each of many argument tuples in a
+ * single loop, converting all arguments before and all results after, so
+ * each call costs little more than the native call itself.
+ */
+
+/// Where M finds the argument tuples and puts the results.
+enum {
+	CFFX_MAP_STACK  = 0,
+	CFFX_MAP_SPACE  = 1,
+	CFFX_MAP_NATIVE = 2
+};
+
+/// Round size up to a multiple of alignment.
+#define CFFX_ALIGN(m_size, m_alignment) \
+	(((m_size) + (m_alignment) - 1) / (m_alignment) * (m_alignment))
+
+/// Size of an argument tuple in an array: like a struct of the arguments.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static size_t tuple_size(const cffiSignature * restrict sig)
+{
+	size_t alignment = 1;
+	for (unsigned int i = 0; i < sig->nargs; i++) {
+		if (sig->argtypes[i]->alignment > alignment)
+			alignment = sig->argtypes[i]->alignment;
+	}
+	return CFFX_ALIGN(sig->argsSize, alignment);
+}
+
+/// Store the return value libffi wrote at result as a plain value of the
+/// return type at dest.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void narrow_result(const cffiSignature * restrict sig,
+                                 const unsigned char * restrict result,
+                                 unsigned char * restrict dest)
+{
+	switch (sig->codes[0]) {
+		case CFFI_TYPE_VOID:
+			break;
+		case CFFI_TYPE_INT8:
+		case CFFI_TYPE_INT16:
+		case CFFI_TYPE_INT32: {
+			ffi_sarg v;
+			memcpy(&v, result, sizeof(v));
+			finger_CFFI_store_cell(sig->codes[0], (funge_cell)v, dest);
+			break;
+		}
+		case CFFI_TYPE_UINT8:
+		case CFFI_TYPE_UINT16:
+		case CFFI_TYPE_UINT32: {
+			ffi_arg v;
+			memcpy(&v, result, sizeof(v));
+			finger_CFFI_store_cell(sig->codes[0], (funge_cell)v, dest);
+			break;
+		}
+		default:
+			memcpy(dest, result, sig->cif.rtype->size);
+			break;
+	}
+}
+
+/**
+ * Call func for count argument tuples at tuples, and store the results as an
+ * array of the return type at results (unless it returns void).
+ */
+FUNGE_ATTR_FAST
+static void map_native(instructionPointer * restrict ip, cffiSignature * restrict sig,
+                       void * func, unsigned char * tuples,
+                       unsigned char * results, size_t count)
+{
+	void ** arguments = alloca((sig->nargs + 1) * sizeof(void*));
+	unsigned char * result = alloca(sig->returnSize);
+	size_t stride = tuple_size(sig);
+	size_t resultSize = sig->codes[0] == CFFI_TYPE_VOID ? 0 : sig->cif.rtype->size;
+	instructionPointer * caller = finger_CFFI_caller;
+
+	finger_CFFI_caller = ip;
+	for (size_t n = 0; n < count; n++) {
+		for (unsigned int i = 0; i < sig->nargs; i++)
+			arguments[i] = tuples + sig->offsets[i];
+		ffi_call(&sig->cif, (void (*)(void))(uintptr_t)func, result, arguments);
+		narrow_result(sig, result, results);
+		tuples += stride;
+		results += resultSize;
+	}
+	finger_CFFI_end_call(ip, caller);
+}
+
+/**
+ * Call func for count tuples of cells in cells, replacing the first count
+ * cells with the results (unless it returns void). All types must take one
+ * cell.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void map_cells(instructionPointer * restrict ip, cffiSignature * restrict sig,
+                      void * func, funge_cell * restrict cells, size_t count)
+{
+	unsigned char * args = alloca(sig->argsSize + 1);
+	void ** arguments = alloca((sig->nargs + 1) * sizeof(void*));
+	unsigned char * result = alloca(sig->returnSize);
+	unsigned char * value = alloca(sig->returnSize);
+	const funge_cell * tuple = cells;
+	instructionPointer * caller = finger_CFFI_caller;
+
+	for (unsigned int i = 0; i < sig->nargs; i++)
+		arguments[i] = args + sig->offsets[i];
+	finger_CFFI_caller = ip;
+	for (size_t n = 0; n < count; n++) {
+		for (unsigned int i = 0; i < sig->nargs; i++)
+			finger_CFFI_store_cell(sig->codes[i + 1], tuple[i], arguments[i]);
+		tuple += sig->nargs;
+		ffi_call(&sig->cif, (void (*)(void))(uintptr_t)func, result, arguments);
+		// Tuple n has been read already, so result n can go over it.
+		if (sig->codes[0] != CFFI_TYPE_VOID) {
+			narrow_result(sig, result, value);
+			cells[n] = finger_CFFI_load_cell(sig->codes[0], value);
+		}
+	}
+	finger_CFFI_end_call(ip, caller);
+}
+
+/// Check if all arguments and the return value (unless void) take one cell.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static bool is_cell_signature(const cffiSignature * restrict sig)
+{
+	if (sig->codes[0] != CFFI_TYPE_VOID && !finger_CFFI_is_cell_type(sig->codes[0]))
+		return false;
+	for (unsigned int i = 1; i <= sig->nargs; i++) {
+		if (!finger_CFFI_is_cell_type(sig->codes[i]))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The buffers of M are allocated for each M. Shared ones could be grown
+ * (and moved) by a callback using CFFI J, K, Q, R or another M in the middle
+ * of the loop.
+ */
+
+/// M in stack mode.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool map_stack(instructionPointer * restrict ip, cffiSignature * restrict sig, size_t count)
+{
+	size_t stride = tuple_size(sig);
+	size_t resultSize = sig->codes[0] == CFFI_TYPE_VOID ? 0 : sig->cif.rtype->size;
+	size_t resultsOffset;
+	unsigned char * buffer;
+	void * func;
+
+	if (stride != 0 && count > SIZE_MAX / 2 / stride)
+		return false;
+	if (resultSize != 0 && count > SIZE_MAX / 2 / resultSize)
+		return false;
+	// Results after the tuples, aligned for any type.
+	resultsOffset = CFFX_ALIGN(count * stride, CFFX_JOB_ALIGN);
+	buffer = malloc(resultsOffset + count * resultSize + 1);
+	if (FUNGE_UNLIKELY(!buffer))
+		return false;
+	for (size_t n = 0; n < count; n++) {
+		for (unsigned int i = 0; i < sig->nargs; i++)
+			finger_CFFI_pop_value(ip, sig->codes[i + 1], buffer + n * stride + sig->offsets[i]);
+	}
+	func = finger_CFFI_pop_pointer(ip);
+	if (FUNGE_UNLIKELY(!func)) {
+		free(buffer);
+		return false;
+	}
+	map_native(ip, sig, func, buffer, buffer + resultsOffset, count);
+	// Like CFFI K: the first result ends up on top.
+	if (resultSize != 0) {
+		for (size_t n = count; n-- > 0;)
+			finger_CFFI_push_value(ip, sig->codes[0], buffer + resultsOffset + n * resultSize);
+	}
+	free(buffer);
+	return true;
+}
+
+/// M in Funge-Space mode.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool map_space(instructionPointer * restrict ip, cffiSignature * restrict sig, size_t count)
+{
+	funge_vector results = stack_pop_vector(ip->stack);
+	funge_vector tuples = stack_pop_vector(ip->stack);
+	size_t cellCount;
+	funge_cell * cells;
+	void * func = finger_CFFI_pop_pointer(ip);
+
+	if (FUNGE_UNLIKELY(!func) || !is_cell_signature(sig))
+		return false;
+	if (count > SIZE_MAX / sizeof(funge_cell) / (sig->nargs ? sig->nargs : 1))
+		return false;
+	cellCount = count * sig->nargs;
+	cells = malloc((cellCount > count ? cellCount : count) * sizeof(funge_cell) + 1);
+	if (FUNGE_UNLIKELY(!cells))
+		return false;
+	tuples.x += ip->storageOffset.x;
+	tuples.y += ip->storageOffset.y;
+	results.x += ip->storageOffset.x;
+	results.y += ip->storageOffset.y;
+	fungespace_get_cells(cells, cellCount, &tuples);
+	map_cells(ip, sig, func, cells, count);
+	if (sig->codes[0] != CFFI_TYPE_VOID)
+		fungespace_set_cells(cells, count, &results);
+	free(cells);
+	return true;
+}
+
+/// M in native mode.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool map_array(instructionPointer * restrict ip, cffiSignature * restrict sig, size_t count)
+{
+	unsigned char * results = finger_CFFI_pop_pointer(ip);
+	unsigned char * tuples = finger_CFFI_pop_pointer(ip);
+	size_t resultSize = sig->codes[0] == CFFI_TYPE_VOID ? 0 : sig->cif.rtype->size;
+	void * func = finger_CFFI_pop_pointer(ip);
+
+	if (FUNGE_UNLIKELY(!func) || (!tuples && sig->nargs != 0 && count != 0)) {
+		finger_CFFI_push_pointer(ip, results);
+		return false;
+	}
+	if (!results && resultSize != 0) {
+		if (count > SIZE_MAX / resultSize)
+			goto error;
+		results = malloc(count * resultSize + 1);
+		if (FUNGE_UNLIKELY(!results))
+			goto error;
+	}
+	map_native(ip, sig, func, tuples, results, count);
+	finger_CFFI_push_pointer(ip, results);
+	return true;
+error:
+	finger_CFFI_push_pointer(ip, NULL);
+	return false;
+}
+
+/// M - Map a call over many argument tuples
+static void finger_CFFX_map(instructionPointer * ip)
+{
+	cffiSignature * sig = finger_CFFI_pop_pointer(ip);
+	funge_cell mode = stack_pop(ip->stack);
+	funge_cell count = stack_pop(ip->stack);
+	bool ok;
+
+	if (FUNGE_UNLIKELY(!sig) || count < 0) {
+		ip_reverse(ip);
+		return;
+	}
+	switch (mode) {
+		case CFFX_MAP_STACK:
+			ok = map_stack(ip, sig, (size_t)count);
+			break;
+		case CFFX_MAP_SPACE:
+			ok = map_space(ip, sig, (size_t)count);
+			break;
+		case CFFX_MAP_NATIVE:
+			ok = map_array(ip, sig, (size_t)count);
+			break;
+		default:
+			ok = false;
+			break;
+	}
+	if (!ok)
+		ip_reverse(ip);
+}
+
+/*
+ * Temporary strings. V and Z make C strings in memory that CFFI frees when
+ * the next call returns, so passing a string costs one copy and no F.
+ */
+
+/// V - Copy a row of Funge-Space to a temporary C string
+static void finger_CFFX_row_string(instructionPointer * ip)
+{
+	funge_cell n = stack_pop(ip->stack);
+	funge_vector pos = stack_pop_vector(ip->stack);
+	funge_cell * cells;
+	unsigned char * str;
+
+	if (n < 0 || !(str = finger_CFFI_temporary(ip, (size_t)n + 1))) {
+		ip_reverse(ip);
+		return;
+	}
+	if (n > 0) {
+		cells = finger_CFFI_get_cell_buffer((size_t)n);
+		if (FUNGE_UNLIKELY(!cells)) {
+			ip_reverse(ip);
+			return;
+		}
+		pos.x += ip->storageOffset.x;
+		pos.y += ip->storageOffset.y;
+		fungespace_get_cells(cells, (size_t)n, &pos);
+		for (size_t i = 0; i < (size_t)n; i++)
+			str[i] = (unsigned char)cells[i];
+	}
+	str[n] = '\0';
+	finger_CFFI_push_pointer(ip, str);
+}
+
+/// Z - Pop a 0gnirts as a temporary C string
+static void finger_CFFX_stack_string(instructionPointer * ip)
+{
+	size_t length = stack_strlen(ip->stack);
+	unsigned char * str = finger_CFFI_temporary(ip, length + 1);
+
+	if (FUNGE_UNLIKELY(!str)) {
+		ip_reverse(ip);
+		return;
+	}
+	stack_pop_string_into(ip->stack, str, length);
+	finger_CFFI_push_pointer(ip, str);
+}
+
+bool finger_CFFX_load(instructionPointer * ip)
+{
+	// Everything is done on the pointer stack of CFFI.
+	if (!ip->fingerCFFIstate)
+		return false;
+	interpreter_thread = pthread_self();
+	manager_add_opcode(CFFX, 'B', bind);
+	manager_add_opcode(CFFX, 'G', get_preloaded);
+	manager_add_opcode(CFFX, 'M', map);
+	manager_add_opcode(CFFX, 'O', call_async);
+	manager_add_opcode(CFFX, 'P', poll);
+	manager_add_opcode(CFFX, 'U', unbind);
+	manager_add_opcode(CFFX, 'V', row_string);
+	manager_add_opcode(CFFX, 'W', wait);
+	manager_add_opcode(CFFX, 'X', return);
+	manager_add_opcode(CFFX, 'Z', stack_string);
+	return true;
+}
@@ -19,21 +19,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+// It need to get it's own prototypes from the header.
+#define FUNGE_EXTENDS_FILE
+
 #include "FILE.h"
+#include "../../ioloop.h"
+#include "../../settings.h"
 #include "../../stack.h"
-#include "../../../lib/stringbuffer/stringbuffer.h"
 #include "../../diagnostic.h"
 
 #include <assert.h>
 #include <stdio.h> /* fclose, fopen, fread, fwrite ... */
 #include <unistd.h> /* fcntl, unlink */
 #include <fcntl.h> /* fcntl */
+#include <stdint.h> /* SIZE_MAX */
+#include <string.h> /* memchr, memcpy */
+#include <sys/mman.h> /* mmap, munmap */
+#include <sys/stat.h> /* fstat */
 
 // Based on how CCBI does it.
 
 typedef struct sFungeFileHandle {
 	FILE      * file;
 	funge_vector buffvect; // IO buffer in Funge-Space
+	bool         canWait;    // Unbuffered pipe or device, see wait_for_handle()
+	bool         pushedBack; // G left a char in the stdio buffer
+	// Mode 6: the whole file is mapped and read from here instead of stdio.
+	unsigned char * map;
+	size_t       mapLength;
+	size_t       mapPos;
 } FungeFileHandle;
 
 #define ALLOCCHUNK 2
@@ -77,6 +91,9 @@ static inline funge_cell allocate_handle(void)
 	if (!handles[h])
 		return -1;
 	handles[h]->file = NULL;
+	handles[h]->canWait = false;
+	handles[h]->pushedBack = false;
+	handles[h]->map = NULL;
 	return h;
 }
 
@@ -105,6 +122,72 @@ static inline bool valid_handle(funge_cell h)
 	}
 }
 
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+FILE* finger_FILE_LookupHandle(funge_cell h)
+{
+	// The stdio position of a mapped file is meaningless.
+	if (!valid_handle(h) || handles[h]->map)
+		return NULL;
+	return handles[h]->file;
+}
+
+/// Buffer for G, R and W, kept between calls.
+static unsigned char * io_buffer = NULL;
+static size_t io_buffer_size = 0;
+
+/// Get the I/O buffer, with room for at least size bytes.
+/// @return The buffer, or NULL if out of memory.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static unsigned char * get_io_buffer(size_t size)
+{
+	if (size > io_buffer_size) {
+		size_t newSize = io_buffer_size ? io_buffer_size : 256;
+		unsigned char * buffer;
+		while (newSize < size)
+			newSize *= 2;
+		buffer = (unsigned char*)realloc(io_buffer, newSize);
+		if (FUNGE_UNLIKELY(!buffer))
+			return NULL;
+		io_buffer = buffer;
+		io_buffer_size = newSize;
+	}
+	return io_buffer;
+}
+
+/// Map a file opened with mode 6. If that fails it is just read with stdio.
+FUNGE_ATTR_FAST
+static void map_handle(funge_cell h)
+{
+	struct stat st;
+	void * map;
+
+	// Empty files can't be mapped, and files too large for the address
+	// space are read normally.
+	if (fstat(fileno(handles[h]->file), &st) != 0 || !S_ISREG(st.st_mode)
+	    || st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX)
+		return;
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+	           fileno(handles[h]->file), 0);
+	if (map == MAP_FAILED)
+		return;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+	handles[h]->map = map;
+	handles[h]->mapLength = (size_t)st.st_size;
+	handles[h]->mapPos = 0;
+}
+
+/// Park the IP if reading from the file would block, see ioloop.h.
+/// @return False if the IP was parked.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static inline bool wait_for_handle(instructionPointer * ip, funge_cell h)
+{
+	if (!handles[h]->canWait || handles[h]->pushedBack)
+		return true;
+	return ioloop_wait_readable(ip, fileno(handles[h]->file));
+}
+
 /// C - Close a file
 static void finger_FILE_fclose(instructionPointer * ip)
 {
@@ -116,6 +199,9 @@ static void finger_FILE_fclose(instructionPointer * ip)
 		return;
 	}
 
+	if (handles[h]->map)
+		munmap(handles[h]->map, handles[h]->mapLength);
+	ioloop_fd_closing(fileno(handles[h]->file));
 	if (fclose(handles[h]->file) != 0)
 		ip_reverse(ip);
 
@@ -136,70 +222,101 @@ static void finger_FILE_delete(instructionPointer * ip)
 }
 
 
+/// G from a mapped file: find the end of the line without copying.
+FUNGE_ATTR_FAST
+static void fgets_mapped(instructionPointer * ip, FungeFileHandle * handle)
+{
+	size_t pos = handle->mapPos < handle->mapLength ? handle->mapPos : handle->mapLength;
+	const unsigned char * start = handle->map + pos;
+	size_t left = handle->mapLength - pos;
+	size_t len = left;
+	const unsigned char * nl = memchr(start, '\n', left);
+	const unsigned char * cr = memchr(start, '\r', nl ? (size_t)(nl - start) : left);
+	unsigned char * buf;
+
+	// A lone \r ends the line as well, \r\n is one line ending.
+	if (cr && cr + 1 != nl)
+		len = (size_t)(cr + 1 - start);
+	else if (nl)
+		len = (size_t)(nl + 1 - start);
+
+	buf = get_io_buffer(len + 1);
+	if (FUNGE_UNLIKELY(!buf)) {
+		ip_reverse(ip);
+		return;
+	}
+	memcpy(buf, start, len);
+	buf[len] = '\0';
+	handle->mapPos = pos + len;
+	stack_push_string(ip->stack, buf, len);
+	stack_push(ip->stack, (funge_cell)len);
+}
+
 /// G - Get string from file (like c fgets)
 static void finger_FILE_fgets(instructionPointer * ip)
 {
 	funge_cell h;
 	FILE * fp;
+	unsigned char * buf;
+	size_t len = 0;
+	int ch;
 
 	h = stack_peek(ip->stack);
 	if (!valid_handle(h)) {
 		ip_reverse(ip);
 		return;
 	}
+	if (handles[h]->map) {
+		fgets_mapped(ip, handles[h]);
+		return;
+	}
+	if (!wait_for_handle(ip, h))
+		return;
 
 	fp = handles[h]->file;
+	handles[h]->pushedBack = false;
 
-	{
-		StringBuffer *sb;
-		int ch;
-		sb = stringbuffer_new();
-		if (!sb) {
+	while (true) {
+		// Room for this char, maybe a \n after a \r, and the terminating 0.
+		if (len + 3 > io_buffer_size && !get_io_buffer(len + 3)) {
 			ip_reverse(ip);
 			return;
 		}
-
-		while (true) {
-			ch = fgetc(fp);
-			switch (ch) {
-				case '\r':
-					stringbuffer_append_char(sb, (char)ch);
-					ch = fgetc(fp);
-					if (ch != '\n') {
-						ungetc(ch, fp);
-						goto endofloop;
-					}
-				// Intentional fallthrough.
-				case '\n':
-					stringbuffer_append_char(sb, (char)ch);
+		buf = io_buffer;
+		ch = cf_getc_unlocked(fp);
+		switch (ch) {
+			case '\r':
+				buf[len++] = (unsigned char)ch;
+				ch = cf_getc_unlocked(fp);
+				if (ch != '\n') {
+					if (ungetc(ch, fp) != EOF)
+						handles[h]->pushedBack = true;
 					goto endofloop;
+				}
+			// Intentional fallthrough.
+			case '\n':
+				buf[len++] = (unsigned char)ch;
+				goto endofloop;
+
+			case EOF:
+				if (ferror(fp)) {
+					clearerr(fp);
+					ip_reverse(ip);
+					return;
+				} else {
+					goto endofloop;
+				}
 
-				case EOF:
-					if (ferror(fp)) {
-						clearerr(fp);
-						ip_reverse(ip);
-						stringbuffer_destroy(sb);
-						return;
-					} else {
-						goto endofloop;
-					}
-
-				default:
-					stringbuffer_append_char(sb, (char)ch);
-					break;
-			}
-		}
-	// Yeah, can't break two levels otherwise...
-	endofloop: {
-			char * str;
-			size_t len;
-			str = stringbuffer_finish(sb, &len);
-			stack_push_string(ip->stack, (unsigned char*)str, len);
-			stack_push(ip->stack, (funge_cell)len);
-			free(str);
-			return;
+			default:
+				buf[len++] = (unsigned char)ch;
+				break;
 		}
 	}
+	// Yeah, can't break two levels otherwise...
+endofloop:
+	buf[len] = '\0';
+	stack_push_string(ip->stack, buf, len);
+	stack_push(ip->stack, (funge_cell)len);
 }
 
 /// L - Get current location in file
@@ -214,6 +331,11 @@ static void finger_FILE_ftell(instructionPointer * ip)
 		return;
 	}
 
+	if (handles[h]->map) {
+		stack_push(ip->stack, (funge_cell)handles[h]->mapPos);
+		return;
+	}
+
 	pos = ftell(handles[h]->file);
 
 	if (pos == -1) {
@@ -233,6 +355,7 @@ static const char* const mode_table[] = {
 	/*3*/"r+b",
 	/*4*/"w+b",
 	/*5*/"a+b",
+	/*6*/"rb", // cfunge extension: mapped with mmap() where possible
 };
 
 /// O - Open a file (Va = i/o buffer vector)
@@ -249,7 +372,7 @@ static void finger_FILE_fopen(instructionPointer * ip)
 	mode = stack_pop(ip->stack);
 	vect = stack_pop_vector(ip->stack);
 
-	if (FUNGE_UNLIKELY((mode < 0) || (mode > 5))) {
+	if (FUNGE_UNLIKELY((mode < 0) || (mode > 6))) {
 		goto error;
 	}
 
@@ -272,6 +395,16 @@ static void finger_FILE_fopen(instructionPointer * ip)
 	}
 	if ((mode == 2) || (mode == 5))
 		rewind(handles[h]->file);
+	if (mode == 6)
+		map_handle(h);
+	if (setting_io_event_loop) {
+		struct stat st;
+		// Pipes and devices may have to wait for data. Without a stdio buffer
+		// we can ask the fd if there is any.
+		if (fstat(fileno(handles[h]->file), &st) == 0 && !S_ISREG(st.st_mode)
+		    && setvbuf(handles[h]->file, NULL, _IONBF, 0) == 0)
+			handles[h]->canWait = true;
+	}
 
 	handles[h]->buffvect = vect;
 	stack_push(ip->stack, h);
@@ -319,10 +452,27 @@ static void finger_FILE_fread(instructionPointer * ip)
 		ip_reverse(ip);
 		return;
 	}
+	if (!wait_for_handle(ip, h)) {
+		stack_push(ip->stack, n);
+		return;
+	}
+	handles[h]->pushedBack = false;
+	if (handles[h]->map) {
+		FungeFileHandle * handle = handles[h];
+		size_t pos = handle->mapPos < handle->mapLength ? handle->mapPos : handle->mapLength;
+		size_t bytes_read = handle->mapLength - pos;
+		if ((size_t)n < bytes_read)
+			bytes_read = (size_t)n;
+		fungespace_set_bytes(handle->map + pos, bytes_read, &handle->buffvect);
+		handle->mapPos = pos + bytes_read;
+		if (bytes_read != (size_t)n)
+			ip_reverse(ip);
+		return;
+	}
 	{
 		size_t bytes_read;
 		FILE * fp = handles[h]->file;
-		unsigned char * restrict buf = malloc((size_t)n * sizeof(unsigned char));
+		unsigned char * restrict buf = get_io_buffer((size_t)n);
 		if (!buf) {
 			ip_reverse(ip);
 			return;
@@ -333,18 +483,10 @@ static void finger_FILE_fread(instructionPointer * ip)
 			ip_reverse(ip);
 			if (ferror(fp)) {
 				clearerr(fp);
-				free(buf);
 				return;
 			}
 		}
-		{
-			funge_vector v = handles[h]->buffvect;
-			for (size_t i = 0; i < bytes_read; i++) {
-				fungespace_set(buf[i], &v);
-				v.x++;
-			}
-		}
-		free(buf);
+		fungespace_set_bytes(buf, bytes_read, &handles[h]->buffvect);
 	}
 }
 
@@ -362,6 +504,23 @@ static void finger_FILE_fseek(instructionPointer * ip)
 		return;
 	}
 
+	if (handles[h]->map) {
+		funge_cell base;
+		switch (m) {
+			case 0:  base = 0; break;
+			case 1:  base = (funge_cell)handles[h]->mapPos; break;
+			case 2:  base = (funge_cell)handles[h]->mapLength; break;
+			default: ip_reverse(ip); return;
+		}
+		// Like fseek(), going past the end is fine but before the start isn't.
+		if (n < -base) {
+			ip_reverse(ip);
+			return;
+		}
+		handles[h]->mapPos = (size_t)(base + n);
+		return;
+	}
+
 	switch (m) {
 		case 0:
 			if (fseek(handles[h]->file, (long)n, SEEK_SET) != 0)
@@ -406,20 +565,16 @@ static void finger_FILE_fwrite(instructionPointer * ip)
 	{
 		FILE * fp = handles[h]->file;
 		funge_vector v = handles[h]->buffvect;
-		unsigned char * restrict buf = malloc((size_t)n * sizeof(unsigned char));
+		unsigned char * restrict buf = get_io_buffer((size_t)n);
 		if (FUNGE_UNLIKELY(!buf))
 			DIAG_OOM("Failed to allocate buffer");
-		for (funge_cell i = 0; i < n; i++) {
-			buf[i] = (unsigned char)fungespace_get(&v);
-			v.x++;
-		}
+		fungespace_get_bytes(buf, (size_t)n, &v);
 		if (fwrite(buf, sizeof(unsigned char), (size_t)n, fp) != (size_t)n) {
 			if (ferror(fp)) {
 				clearerr(fp);
 				ip_reverse(ip);
 			}
 		}
-		free(buf);
 	}
 }
 
@@ -27,4 +27,12 @@
 
 bool finger_FILE_load(instructionPointer * ip);
 
+// Used by other fingerprints wanting to use FILE handles, like SCKX
+#ifdef FUNGE_EXTENDS_FILE
+#include <stdio.h>
+
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+FILE* finger_FILE_LookupHandle(funge_cell h);
+#endif
+
 #endif
@@ -0,0 +1,11 @@
+%fingerprint-spec 1.4
+%fprint:SCKX
+%url:doc/SCKX.txt
+%desc:Non-blocking and multiplexed socket extension for SOCK
+%safe:false
+%begin-instrs
+#I	name	desc
+F	sendfile	Send data from a FILE handle to a socket
+N	nonblocking	Set or clear non-blocking mode on a socket
+W	wait	Wait until any of several sockets is ready
+%end
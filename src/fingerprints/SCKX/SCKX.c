@@ -0,0 +1,244 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "SCKX.h"
+#include "../../stack.h"
+
+#define FUNGE_EXTENDS_SOCK
+#include "../SOCK/SOCK.h"
+#define FUNGE_EXTENDS_FILE
+#include "../FILE/FILE.h"
+
+#include <errno.h>
+#include <fcntl.h>   /* fcntl */
+#include <limits.h>  /* INT_MAX */
+#include <poll.h>    /* poll */
+#include <stdint.h>  /* SIZE_MAX */
+#include <stdio.h>   /* fread, fseeko, ftello */
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>  /* send */
+
+#ifdef HAVE_SYS_SENDFILE_H
+#  include <sys/sendfile.h>
+#endif
+
+// Values for the event mask of W.
+#define SCKX_READ  1
+#define SCKX_WRITE 2
+
+/// Size of the buffer used by F when the data has to be copied.
+#define SCKX_COPY_BUFFER 16384
+
+/// Copy up to length bytes from fp to fd through a buffer.
+/// @return Bytes sent, or -1 if nothing could be sent due to an error.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static ssize_t copy_file(int fd, FILE * fp, size_t length)
+{
+	unsigned char buffer[SCKX_COPY_BUFFER];
+	size_t total = 0;
+
+	while (total < length) {
+		size_t chunk = length - total;
+		size_t got, done = 0;
+		if (chunk > sizeof(buffer))
+			chunk = sizeof(buffer);
+		got = fread(buffer, 1, chunk, fp);
+		if (got == 0) {
+			if (ferror(fp)) {
+				clearerr(fp);
+				goto error;
+			}
+			break;
+		}
+		while (done < got) {
+			ssize_t n = send(fd, buffer + done, got - done, 0);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				// Give back what wasn't sent, if the file allows it.
+				fseeko(fp, -(off_t)(got - done), SEEK_CUR);
+				total += done;
+				goto error;
+			}
+			done += (size_t)n;
+		}
+		total += got;
+	}
+	return (ssize_t)total;
+error:
+	return total ? (ssize_t)total : -1;
+}
+
+/// F - Send data from a FILE handle to a socket
+static void finger_SCKX_sendfile(instructionPointer * ip)
+{
+	funge_cell s = stack_pop(ip->stack);
+	funge_cell n = stack_pop(ip->stack);
+	funge_cell f = stack_pop(ip->stack);
+	FungeSocketHandle* handle = finger_SOCK_LookupHandle(s);
+	FILE * fp = finger_FILE_LookupHandle(f);
+	ssize_t sent = -1;
+	bool copy = true;
+
+	if (!handle || !fp || n < 0)
+		goto error;
+
+#ifdef HAVE_SYS_SENDFILE_H
+	{
+		// Let the kernel move the data, starting at the stdio position.
+		// Seeking to the end of what was sent afterwards also drops
+		// anything stdio had buffered.
+		off_t offset = ftello(fp);
+		if (offset != -1) {
+			size_t left = (size_t)n;
+			ssize_t total = 0;
+			int err = 0;
+			while (left > 0) {
+				ssize_t done = sendfile(handle->fd, fileno(fp), &offset, left);
+				if (done == -1 && errno == EINTR)
+					continue;
+				if (done == -1)
+					err = errno;
+				if (done <= 0)
+					break;
+				left -= (size_t)done;
+				total += done;
+			}
+			if (fseeko(fp, offset, SEEK_SET) != 0)
+				goto error;
+			// Files sendfile() can't read from are copied instead.
+			if (total != 0 || (err != EINVAL && err != ENOSYS)) {
+				copy = false;
+				sent = (total == 0 && err != 0) ? -1 : total;
+			}
+		}
+	}
+#endif
+	if (copy)
+		sent = copy_file(handle->fd, fp, (size_t)n);
+
+	stack_push(ip->stack, (funge_cell)sent);
+	if (sent == -1)
+		goto error;
+	return;
+error:
+	ip_reverse(ip);
+}
+
+/// N - Set or clear non-blocking mode on a socket
+static void finger_SCKX_nonblocking(instructionPointer * ip)
+{
+	funge_cell s    = stack_pop(ip->stack);
+	funge_cell flag = stack_pop(ip->stack);
+	FungeSocketHandle* handle = finger_SOCK_LookupHandle(s);
+	int flags;
+
+	if (!handle)
+		goto error;
+
+	flags = fcntl(handle->fd, F_GETFL);
+	if (flags == -1)
+		goto error;
+	if (flag)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+	if (fcntl(handle->fd, F_SETFL, flags) == -1)
+		goto error;
+	return;
+error:
+	ip_reverse(ip);
+}
+
+/// W - Wait until any of several sockets is ready
+static void finger_SCKX_wait(instructionPointer * ip)
+{
+	funge_cell timeout = stack_pop(ip->stack);
+	funge_cell events  = stack_pop(ip->stack);
+	funge_cell n       = stack_pop(ip->stack);
+	struct pollfd * fds     = NULL;
+	funge_cell    * handles = NULL;
+	short pollEvents = 0;
+	bool valid = true;
+	int ready;
+
+	if (n < 0 || (uint64_t)n > SIZE_MAX / sizeof(struct pollfd))
+		goto error;
+	if (events & SCKX_READ)
+		pollEvents |= POLLIN;
+	if (events & SCKX_WRITE)
+		pollEvents |= POLLOUT;
+	if (pollEvents == 0 || (events & ~(SCKX_READ | SCKX_WRITE)) != 0)
+		valid = false;
+
+	fds     = (struct pollfd*)malloc((size_t)n * sizeof(struct pollfd) + 1);
+	handles = (funge_cell*)malloc((size_t)n * sizeof(funge_cell) + 1);
+	if (!fds || !handles)
+		goto error;
+
+	// The first handle is deepest on the stack.
+	for (funge_cell i = n; i-- > 0;) {
+		FungeSocketHandle* handle;
+		handles[i] = stack_pop(ip->stack);
+		handle = finger_SOCK_LookupHandle(handles[i]);
+		if (!handle) {
+			valid = false;
+			continue;
+		}
+		fds[i].fd      = handle->fd;
+		fds[i].events  = pollEvents;
+		fds[i].revents = 0;
+	}
+	if (!valid)
+		goto error;
+
+	if (timeout < 0)
+		timeout = -1;
+	else if (timeout > INT_MAX)
+		timeout = INT_MAX;
+	do {
+		ready = poll(fds, (nfds_t)n, (int)timeout);
+	} while (ready == -1 && errno == EINTR);
+	if (ready == -1)
+		goto error;
+
+	// Hangups and errors count as ready, the next read or write reports them.
+	for (funge_cell i = 0; i < n; i++) {
+		if (fds[i].revents != 0)
+			stack_push(ip->stack, handles[i]);
+	}
+	stack_push(ip->stack, ready);
+	goto end;
+error:
+	ip_reverse(ip);
+end:
+	free(fds);
+	free(handles);
+}
+
+bool finger_SCKX_load(instructionPointer * ip)
+{
+	manager_add_opcode(SCKX, 'F', sendfile);
+	manager_add_opcode(SCKX, 'N', nonblocking);
+	manager_add_opcode(SCKX, 'W', wait);
+	return true;
+}
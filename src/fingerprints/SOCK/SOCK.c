@@ -23,6 +23,7 @@
 #define FUNGE_EXTENDS_SOCK
 
 #include "SOCK.h"
+#include "../../ioloop.h"
 #include "../../stack.h"
 
 #include <unistd.h> /* close, fcntl */
@@ -55,16 +56,19 @@ static inline funge_cell findNextfree_handle(void)
 		if (sockets[i] == NULL)
 			return (funge_cell)i;
 	}
-	// No free one, extend array..
+	// No free one, extend array. Double it, servers may have a lot of
+	// connections open.
 	{
-		FungeSocketHandle** newlist = (FungeSocketHandle**)realloc(sockets, (maxHandle + ALLOCCHUNK) * sizeof(FungeSocketHandle*));
+		size_t oldMax = maxHandle;
+		size_t newMax = maxHandle ? maxHandle * 2 : ALLOCCHUNK;
+		FungeSocketHandle** newlist = (FungeSocketHandle**)realloc(sockets, newMax * sizeof(FungeSocketHandle*));
 		if (!newlist)
 			return -1;
 		sockets = newlist;
-		for (size_t i = maxHandle; i < (maxHandle + ALLOCCHUNK); i++)
+		for (size_t i = oldMax; i < newMax; i++)
 			sockets[i] = NULL;
-		maxHandle += ALLOCCHUNK;
-		return (funge_cell)(maxHandle - ALLOCCHUNK);
+		maxHandle = newMax;
+		return (funge_cell)oldMax;
 	}
 }
 
@@ -95,6 +99,28 @@ static inline void free_handle(funge_cell h)
 	sockets[h] = NULL;
 }
 
+/// Buffer for R and W, kept between calls.
+static unsigned char * io_buffer = NULL;
+static size_t io_buffer_size = 0;
+
+/// Get the I/O buffer, with room for at least size bytes.
+/// @return The buffer, or NULL if out of memory.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static unsigned char * get_io_buffer(size_t size)
+{
+	// Like malloc(0) used to, a zero size must still give a buffer.
+	if (size == 0)
+		size = 1;
+	if (size > io_buffer_size) {
+		unsigned char * buffer = (unsigned char*)realloc(io_buffer, size);
+		if (FUNGE_UNLIKELY(!buffer))
+			return NULL;
+		io_buffer = buffer;
+		io_buffer_size = size;
+	}
+	return io_buffer;
+}
+
 /// Checks if handle is valid.
 FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
 static inline bool valid_handle(funge_cell h)
@@ -128,7 +154,11 @@ static inline int popFam(instructionPointer * ip)
 /// A - Accept a connection
 static void finger_SOCK_accept(instructionPointer * ip)
 {
-	funge_cell s = stack_pop(ip->stack);
+	funge_cell s = stack_peek(ip->stack);
+
+	if (valid_handle(s) && !ioloop_wait_readable(ip, sockets[s]->fd))
+		return;
+	stack_discard(ip->stack, 1);
 
 	if (!valid_handle(s))
 		goto error;
@@ -258,6 +288,7 @@ static void finger_SOCK_kill(instructionPointer * ip)
 	funge_cell s       = stack_pop(ip->stack);
 	if (!valid_handle(s))
 		goto invalid;
+	ioloop_fd_closing(sockets[s]->fd);
 	shutdown(sockets[s]->fd, SHUT_RDWR);
 	if (close(sockets[s]->fd) == -1) {
 		goto error;
@@ -324,12 +355,17 @@ error:
 /// R - Receive from a socket
 static void finger_SOCK_receive(instructionPointer * ip)
 {
-	unsigned char *buffer = NULL;
+	unsigned char *buffer;
 	ssize_t got;
-	funge_cell s   = stack_pop(ip->stack);
-	funge_cell len = stack_pop(ip->stack);
+	funge_cell s, len;
+	funge_vector v;
 
-	funge_vector v = stack_pop_vector(ip->stack);
+	s = stack_peek(ip->stack);
+	if (valid_handle(s) && !ioloop_wait_readable(ip, sockets[s]->fd))
+		return;
+	stack_discard(ip->stack, 1);
+	len = stack_pop(ip->stack);
+	v = stack_pop_vector(ip->stack);
 
 	if (len < 0)
 		goto error;
@@ -340,7 +376,7 @@ static void finger_SOCK_receive(instructionPointer * ip)
 	v.x += ip->storageOffset.x;
 	v.y += ip->storageOffset.y;
 
-	buffer = malloc((size_t)len * sizeof(unsigned char));
+	buffer = get_io_buffer((size_t)len);
 	if (FUNGE_UNLIKELY(!buffer))
 		goto error;
 
@@ -351,15 +387,10 @@ static void finger_SOCK_receive(instructionPointer * ip)
 	if (got == -1)
 		goto error;
 
-	for (ssize_t i = 0; i < got; ++i)
-		fungespace_set(buffer[i], vector_create_ref(v.x + i, v.y));
-
-	goto end;
+	fungespace_set_bytes(buffer, (size_t)got, &v);
+	return;
 error:
 	ip_reverse(ip);
-end:
-	if (buffer)
-		free(buffer);
 }
 
 /// S - Create a socket
@@ -409,7 +440,7 @@ error:
 /// W - Write to a socket
 static void finger_SOCK_write(instructionPointer * ip)
 {
-	unsigned char *buffer = NULL;
+	unsigned char *buffer;
 	ssize_t sent;
 	funge_cell s   = stack_pop(ip->stack);
 	funge_cell len = stack_pop(ip->stack);
@@ -425,12 +456,11 @@ static void finger_SOCK_write(instructionPointer * ip)
 	v.x += ip->storageOffset.x;
 	v.y += ip->storageOffset.y;
 
-	buffer = malloc((size_t)len * sizeof(unsigned char));
+	buffer = get_io_buffer((size_t)len);
 	if (FUNGE_UNLIKELY(!buffer))
 		goto error;
 
-	for (size_t i = 0; i < (size_t)len; ++i)
-		buffer[i] = (unsigned char)fungespace_get(vector_create_ref(v.x + (funge_cell)i, v.y));
+	fungespace_get_bytes(buffer, (size_t)len, &v);
 
 	sent = send(sockets[s]->fd, buffer, (size_t)len, 0);
 
@@ -438,13 +468,9 @@ static void finger_SOCK_write(instructionPointer * ip)
 
 	if (sent == -1)
 		goto error;
-
-	goto end;
+	return;
 error:
 	ip_reverse(ip);
-end:
-	if (buffer)
-		free(buffer);
 }
 
 FUNGE_ATTR_FAST static inline bool init_handle_list(void)
@@ -57,6 +57,7 @@
 #include "REXP/REXP.h"
 #include "ROMA/ROMA.h"
 #include "SCKE/SCKE.h"
+#include "SCKX/SCKX.h"
 #include "SOCK/SOCK.h"
 #include "STRN/STRN.h"
 #include "SUBR/SUBR.h"
@@ -65,6 +66,7 @@
 #include "TOYS/TOYS.h"
 #include "TURT/TURT.h"
 #include "CFFI/CFFI.h"
+#include "CFFX/CFFX.h"
 
 typedef struct s_ImplementedFingerprintEntry {
 	const funge_cell         fprint;   /**< Fingerprint. */
@@ -94,8 +96,11 @@ static const ImplementedFingerprintEntry ImplementedFingerprints[] = {
 	{ .fprint = 0x424f4f4c, .uri = NULL, .loader = &finger_BOOL_load, .opcodes = "ANOX",
 	  .url = "http://rcfunge98.com/rcsfingers.html#BOOL", .safe = true },
 	// CFFI
-	{ .fprint = 0x43464649, .uri = NULL, .loader = &finger_CFFI_load, .opcodes = "BCDFGILMOPSTUWY",
+	{ .fprint = 0x43464649, .uri = NULL, .loader = &finger_CFFI_load, .opcodes = "ABCDEFGHIJKLMNOPQRSTUVWXYZ",
 	  .url = "https://github.com/oshaboy/rcfunge-with-ffi", .safe = false },
+	// CFFX - Callbacks and more for CFFI
+	{ .fprint = 0x43464658, .uri = NULL, .loader = &finger_CFFX_load, .opcodes = "BGMOPUVWXZ",
+	  .url = "doc/CFFX.txt", .safe = false },
 #if !defined(CFUN_NO_FLOATS)
 	// CPLI - Complex Integer extension
 	{ .fprint = 0x43504c49, .uri = NULL, .loader = &finger_CPLI_load, .opcodes = "ADMOSV",
@@ -171,6 +176,9 @@ static const ImplementedFingerprintEntry ImplementedFingerprints[] = {
 	// SCKE - TCP/IP async socket and dns resolving extension
 	{ .fprint = 0x53434b45, .uri = NULL, .loader = &finger_SCKE_load, .opcodes = "HP",
 	  .url = "http://glfunge98.sourceforge.net/", .safe = false },
+	// SCKX - Non-blocking and multiplexed socket extension for SOCK
+	{ .fprint = 0x53434b58, .uri = NULL, .loader = &finger_SCKX_load, .opcodes = "FNW",
+	  .url = "doc/SCKX.txt", .safe = false },
 	// SOCK - TCP/IP socket extension
 	{ .fprint = 0x534f434b, .uri = NULL, .loader = &finger_SOCK_load, .opcodes = "ABCIKLORSW",
 	  .url = "http://rcfunge98.com/rcsfingers.html#SOCK", .safe = false },
@@ -30,11 +30,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h> /* exit */
-#include <string.h> /* memcpy, strlen */
+#include <string.h> /* strlen */
 
 
-#define ALLOCCHUNKSIZE 2
-
 #define MANAGER_INTERNAL
 #include "fingerprints.h"
 
@@ -45,75 +43,63 @@
  * Opcode Stack functions *
  **************************/
 
-#ifdef CONCURRENT_FUNGE
 /**
- * Duplicate an opcode stack, used for split (t).
+ * Drop a reference to a layer, freeing it (and possibly the layers below it)
+ * if nothing refers to it any longer.
  */
-FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
-static inline void opcode_stack_duplicate(const fungeOpcodeStack * restrict old,
-                                          fungeOpcodeStack * restrict new)
+FUNGE_ATTR_FAST
+static inline void opcode_layer_release(fungeOpcodeLayer * layer)
 {
-	if (old->top) {
-		new->entries = (fingerprintOpcode*)malloc((old->top + 1) * sizeof(fingerprintOpcode));
-		if (FUNGE_UNLIKELY(!new->entries)) {
-			DIAG_OOM("Couldn't allocate for fingerprint stack");
-		}
-		new->size = old->top + 1;
-		new->top = old->top;
-		// Copy the pointers.
-		memcpy(new->entries, old->entries, new->top * sizeof(fingerprintOpcode));
-	} else {
-		new->entries = NULL;
-		new->top = 0;
-		new->size = 0;
+	while (layer && --layer->refcount == 0) {
+		fungeOpcodeLayer * next = layer->next;
+		free(layer);
+		layer = next;
 	}
 }
-#endif
 
 /// Add an entry to an opcode stack.
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
 bool opcode_stack_push(instructionPointer * restrict ip, unsigned char opcode, fingerprintOpcode func)
 {
-	fungeOpcodeStack * stack = &ip->fingerOpcodes[opcode - 'A'];
-	// Check if we need to realloc. It may also be that stack->entries is NULL
-	// (both stack->top and stack->size are 0 then.
-	if (stack->top == stack->size) {
-		fingerprintOpcode* newstack = realloc(stack->entries, (stack->size + ALLOCCHUNKSIZE) * sizeof(fingerprintOpcode));
-		if (FUNGE_UNLIKELY(!newstack))
-			return false;
-		stack->entries = newstack;
-		stack->entries[stack->top] = func;
-		stack->top++;
-		stack->size += ALLOCCHUNKSIZE;
-	} else {
-		stack->entries[stack->top] = func;
-		stack->top++;
-	}
+	fungeOpcodeOverlay * overlay = &ip->fingerOpcodes;
+	fungeOpcodeLayer * layer = malloc(sizeof(fungeOpcodeLayer));
+	if (FUNGE_UNLIKELY(!layer))
+		return false;
+	// The reference the IP held to the old top is transferred to the new layer.
+	layer->next = overlay->layers[opcode - 'A'];
+	layer->func = func;
+	layer->refcount = 1;
+	overlay->layers[opcode - 'A'] = layer;
+	overlay->dispatch[opcode - 'A'] = func;
 	return true;
 }
 
+/**
+ * Pop a layer from an opcode stack, returning the function in it.
+ * Returns NULL if the stack was empty.
+ */
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
-fingerprintOpcode opcode_stack_pop(instructionPointer * restrict ip, unsigned char opcode)
+static inline fingerprintOpcode opcode_stack_drop(fungeOpcodeOverlay * restrict overlay, unsigned char opcode)
 {
-	fungeOpcodeStack * stack = &ip->fingerOpcodes[opcode - 'A'];
-	if (stack->top == 0) {
+	fungeOpcodeLayer * layer = overlay->layers[opcode - 'A'];
+	fingerprintOpcode func;
+
+	if (layer == NULL)
 		return NULL;
-	} else {
-		return stack->entries[--stack->top];
-	}
+	func = layer->func;
+	overlay->layers[opcode - 'A'] = layer->next;
+	overlay->dispatch[opcode - 'A'] = layer->next ? layer->next->func : NULL;
+	// The IP now refers to the layer below directly.
+	if (layer->next)
+		layer->next->refcount++;
+	opcode_layer_release(layer);
+	return func;
 }
 
-/**
- * Pop a function pointer from an opcode stack, discarding it.
- */
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
-static inline void opcode_stack_drop(fungeOpcodeStack * restrict stack)
+fingerprintOpcode opcode_stack_pop(instructionPointer * restrict ip, unsigned char opcode)
 {
-	if (stack->top == 0) {
-		return;
-	} else {
-		stack->top--;
-	}
+	return opcode_stack_drop(&ip->fingerOpcodes, opcode);
 }
 
 /****************************
@@ -126,17 +112,21 @@ FUNGE_ATTR_FAST void manager_free(instructionPointer * restrict ip)
 	if (FUNGE_UNLIKELY(!ip))
 		return;
 	for (int i = 0; i < FINGEROPCODECOUNT; i++) {
-		free(ip->fingerOpcodes[i].entries);
+		opcode_layer_release(ip->fingerOpcodes.layers[i]);
+		ip->fingerOpcodes.layers[i] = NULL;
+		ip->fingerOpcodes.dispatch[i] = NULL;
 	}
 }
 
 #ifdef CONCURRENT_FUNGE
-/// Duplicate the opcode stacks from one ip to another, for concurrent Funge.
+/// Share the opcode stacks from one ip with another, for concurrent Funge.
 FUNGE_ATTR_FAST void manager_duplicate(const instructionPointer * restrict oldip,
                                        instructionPointer * restrict newip)
 {
+	newip->fingerOpcodes = oldip->fingerOpcodes;
 	for (int i = 0; i < FINGEROPCODECOUNT; i++) {
-		opcode_stack_duplicate(&oldip->fingerOpcodes[i], &newip->fingerOpcodes[i]);
+		if (newip->fingerOpcodes.layers[i])
+			newip->fingerOpcodes.layers[i]->refcount++;
 	}
 }
 #endif
@@ -192,7 +182,7 @@ FUNGE_ATTR_FAST bool manager_unload(instructionPointer * restrict ip, funge_cell
 		return false;
 	max_len = strlen(ImplementedFingerprints[index].opcodes);
 	for (size_t i = 0; i < max_len; i++)
-		opcode_stack_drop(&ip->fingerOpcodes[ImplementedFingerprints[index].opcodes[i] - 'A']);
+		opcode_stack_drop(&ip->fingerOpcodes, (unsigned char)ImplementedFingerprints[index].opcodes[i]);
 	return true;
 }
 
@@ -36,25 +36,41 @@
 /// Forward decl, see ../ip.h
 struct s_instructionPointer;
 
+/// This is for size of opcode array.
+#define FINGEROPCODECOUNT 26
+
 /// Function prototype for a fingerprint instruction.
 typedef void (*fingerprintOpcode)(struct s_instructionPointer * ip);
 
 /**
- * An opcode stack.
+ * One layer of an opcode stack.
+ * Layers are immutable once created and reference counted, so several IPs
+ * (after a split) can share the same chain of layers. Pushing creates a new
+ * layer on top, popping just moves the IP's pointer down one layer.
+ * @warning
+ * Fingerprints should not directly touch these, use the functions below for that.
+ */
+typedef struct s_fungeOpcodeLayer {
+	/// Layer below this one, or NULL if this is the bottom layer.
+	struct s_fungeOpcodeLayer *next;
+	/// Function implementing the instruction in this layer.
+	fingerprintOpcode          func;
+	/// Number of IPs and layers referring to this layer.
+	size_t                     refcount;
+} fungeOpcodeLayer;
+
+/**
+ * The per-IP view of the loaded semantics.
  * @warning
  * Fingerprints should not directly touch these, use the functions below for that.
  */
-typedef struct s_fungeOpcodeStack {
-	/// This is current size of the array entries
-	size_t             size;
-	/// This is current top item in stack (may not be last item)
-	/// Note: One-indexed, as 0 = empty stack.
-	size_t             top;
-	/// Pointer to entries of the stack. Is initialised on demand and may thus
-	/// be NULL before any fingerprint has been loaded that uses this opcode.
-	/// In that case, both size and top are 0.
-	fingerprintOpcode *entries;
-} fungeOpcodeStack;
+typedef struct s_fungeOpcodeOverlay {
+	/// Top layer for each of A-Z. NULL means the stack is empty.
+	fungeOpcodeLayer  *layers[FINGEROPCODECOUNT];
+	/// Cached function of the top layer for each of A-Z, used when
+	/// executing an instruction. Updated whenever layers changes.
+	fingerprintOpcode  dispatch[FINGEROPCODECOUNT];
+} fungeOpcodeOverlay;
 
 /**
  * Function prototype for fingerprint loader. It should load a fingerprint
@@ -95,10 +111,10 @@ void manager_free(struct s_instructionPointer * restrict ip);
 #ifdef CONCURRENT_FUNGE
 /**
  * Duplicate the loaded fingerprint stacks to another IP, used for Concurrent Funge.
+ * This only shares the layers with the old IP, nothing is copied.
  * @warning Don't call this directly from fingerprints.
  * @param oldip Old IP to copy loaded fingerprints from.
  * @param newip Target to copy to.
- * @note If allocation fails it will call DIAG_OOM(). It will not return.
  */
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
 void manager_duplicate(const struct s_instructionPointer * restrict oldip,
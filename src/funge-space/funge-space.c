@@ -35,6 +35,11 @@
 #define CFUNGE_MEMPOOL_HASHLIB
 #include "../../lib/mempool/cfunge_mempool.h"
 
+#include "../strcache.h"
+#ifdef SPINWAIT_PARKING
+#  include "../spinwait.h"
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>     /* fclose, fileno, fopen, fputs, fwrite, ... */
@@ -76,6 +81,10 @@ typedef struct fungeSpace {
 #endif
 	/// Used during loading to handle 0,0 not being least point.
 	bool                          boundsvalid;
+#ifdef SPINWAIT_PARKING
+	/// Number of times fungespace_wrap() actually wrapped.
+	size_t                        wrapCount;
+#endif
 } fungeSpace;
 
 /// Funge-space storage.
@@ -88,7 +97,10 @@ static fungeSpace fspace = {
 	.row_count         = NULL,
 	.boundsexact       = true,
 #endif
-	.boundsvalid       = false
+	.boundsvalid       = false,
+#ifdef SPINWAIT_PARKING
+	.wrapCount         = 0,
+#endif
 };
 
 
@@ -177,6 +189,319 @@ static const v4si fspace_vector_init = {0x20, 0x0, 0x20, 0x0};
 #endif
 
 
+/**********************
+ * File-backed layers *
+ **********************/
+
+/**
+ * A file mapped into Funge-Space by fungespace_map_at_offset().
+ * Cells outside the static array that aren't in the hash table are read from
+ * the mapping, so the file is only read where it is used. A bitmap with one
+ * bit per byte of the file records which cells have been written since, those
+ * no longer show the file.
+ */
+typedef struct fungeLayer {
+	funge_vector    offset;     ///< Where the file starts.
+	funge_cell      width;      ///< Length of the longest line.
+	size_t          rows;       ///< Number of lines.
+	unsigned char * data;       ///< The mapped file.
+	size_t          length;     ///< Length of the file.
+	size_t        * lineStarts; ///< Offset of each line, NULL in binary mode.
+	unsigned char * written;    ///< Bitmap of written cells, by file offset.
+} fungeLayer;
+
+/// Mapped files, in the order they were mapped.
+static fungeLayer * layers = NULL;
+static size_t layerCount = 0;
+
+/// Where line row of a layer ends, without the line ending.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline size_t layer_line_end(const fungeLayer * restrict layer, size_t row)
+{
+	size_t start = layer->lineStarts[row];
+	size_t end = (row + 1 == layer->rows) ? layer->length : layer->lineStarts[row + 1];
+
+	// Only the last line may lack a line ending. \r\n is a single one.
+	if (end > start && layer->data[end - 1] == '\n')
+		end--;
+	if (end > start && layer->data[end - 1] == '\r')
+		end--;
+	return end;
+}
+
+/**
+ * Find the byte of the file that a cell shows.
+ * @return True if there is one, it is then stored in index.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static inline bool layer_index(const fungeLayer * restrict layer,
+                               const funge_vector * restrict position,
+                               size_t * restrict index)
+{
+	funge_unsigned_cell col = (funge_unsigned_cell)position->x - (funge_unsigned_cell)layer->offset.x;
+	funge_unsigned_cell row = (funge_unsigned_cell)position->y - (funge_unsigned_cell)layer->offset.y;
+	size_t start, end;
+
+	if (row >= layer->rows || col >= (funge_unsigned_cell)layer->width)
+		return false;
+	if (layer->lineStarts) {
+		start = layer->lineStarts[row];
+		end = layer_line_end(layer, (size_t)row);
+	} else {
+		start = 0;
+		end = layer->length;
+	}
+	if (col >= end - start)
+		return false;
+	*index = start + (size_t)col;
+	return true;
+}
+
+#define LAYER_WRITTEN(m_layer, m_index) \
+	((m_layer)->written[(m_index) / 8] & (1 << ((m_index) % 8)))
+
+/**
+ * Get a cell from the mapped files, newest first. Only for cells that are
+ * not in the static array or the hash table.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static funge_cell layer_get(const funge_vector * restrict position)
+{
+	for (size_t i = layerCount; i-- > 0;) {
+		size_t index;
+		if (layer_index(&layers[i], position, &index)) {
+			if (LAYER_WRITTEN(&layers[i], index))
+				return (funge_cell)' ';
+			// Spaces in the file are transparent, like for i.
+			if (layers[i].data[index] != ' ')
+				return (funge_cell)layers[i].data[index];
+		}
+	}
+	return (funge_cell)' ';
+}
+
+/// Hide the files at a cell that is being written outside the static array.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void layer_mark_written(const funge_vector * restrict position)
+{
+	for (size_t i = 0; i < layerCount; i++) {
+		size_t index;
+		if (layer_index(&layers[i], position, &index))
+			layers[i].written[index / 8] |= (unsigned char)(1 << (index % 8));
+	}
+}
+
+/// Grow a bounding box to cover all mapped files.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void layer_extend_bounds(funge_vector * restrict min, funge_vector * restrict max)
+{
+	for (size_t i = 0; i < layerCount; i++) {
+		const fungeLayer * layer = &layers[i];
+		funge_cell maxx = layer->offset.x + layer->width - 1;
+		funge_cell maxy = layer->offset.y + (funge_cell)layer->rows - 1;
+		if (layer->width == 0)
+			continue;
+		if (min->x > layer->offset.x) min->x = layer->offset.x;
+		if (min->y > layer->offset.y) min->y = layer->offset.y;
+		if (max->x < maxx) max->x = maxx;
+		if (max->y < maxy) max->y = maxy;
+	}
+}
+
+FUNGE_ATTR_FAST
+static void layer_free_all(void)
+{
+	for (size_t i = 0; i < layerCount; i++) {
+		munmap(layers[i].data, layers[i].length);
+		free(layers[i].lineStarts);
+		free(layers[i].written);
+	}
+	free(layers);
+	layers = NULL;
+	layerCount = 0;
+}
+
+
+/***************************
+ * Native memory overlays *
+ ***************************/
+
+/**
+ * Native memory shown as a rectangle of Funge-Space, see fungespace_attach().
+ * Cells in it are read from and written to the memory, and take priority over
+ * everything else. What was in Funge-Space there before is hidden, not lost.
+ */
+typedef struct fungeOverlay {
+	fungeRect       rect;
+	unsigned char * data;        ///< Row after row, no padding.
+	size_t          elementSize; ///< 1, 2, 4 or 8 bytes.
+	bool            isSigned;
+} fungeOverlay;
+
+/// Attached overlays, in the order they were attached.
+static fungeOverlay * overlays = NULL;
+static size_t overlayCount = 0;
+
+/// Find the newest overlay containing a cell, NULL if none.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline fungeOverlay * overlay_find(const funge_vector * restrict position)
+{
+	for (size_t i = overlayCount; i-- > 0;) {
+		const fungeRect * rect = &overlays[i].rect;
+		if ((funge_unsigned_cell)position->x - (funge_unsigned_cell)rect->x < (funge_unsigned_cell)rect->w
+		    && (funge_unsigned_cell)position->y - (funge_unsigned_cell)rect->y < (funge_unsigned_cell)rect->h)
+			return &overlays[i];
+	}
+	return NULL;
+}
+
+/// Address of the element for a cell in an overlay.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline unsigned char * overlay_address(const fungeOverlay * restrict overlay,
+                                              const funge_vector * restrict position)
+{
+	size_t col = (size_t)(position->x - overlay->rect.x);
+	size_t row = (size_t)(position->y - overlay->rect.y);
+	return overlay->data + (row * (size_t)overlay->rect.w + col) * overlay->elementSize;
+}
+
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static funge_cell overlay_get(const fungeOverlay * restrict overlay,
+                              const funge_vector * restrict position)
+{
+	const unsigned char * p = overlay_address(overlay, position);
+	switch (overlay->elementSize) {
+		case 1:
+			return overlay->isSigned ? (funge_cell)(int8_t)*p : (funge_cell)*p;
+		case 2: {
+			uint16_t v;
+			memcpy(&v, p, sizeof(v));
+			return overlay->isSigned ? (funge_cell)(int16_t)v : (funge_cell)v;
+		}
+		case 4: {
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			return overlay->isSigned ? (funge_cell)(int32_t)v : (funge_cell)v;
+		}
+		default: {
+			uint64_t v;
+			memcpy(&v, p, sizeof(v));
+			return (funge_cell)v;
+		}
+	}
+}
+
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void overlay_set(const fungeOverlay * restrict overlay,
+                        const funge_vector * restrict position,
+                        funge_cell value)
+{
+	unsigned char * p = overlay_address(overlay, position);
+	switch (overlay->elementSize) {
+		case 1:
+			*p = (unsigned char)value;
+			break;
+		case 2: {
+			uint16_t v = (uint16_t)value;
+			memcpy(p, &v, sizeof(v));
+			break;
+		}
+		case 4: {
+			uint32_t v = (uint32_t)value;
+			memcpy(p, &v, sizeof(v));
+			break;
+		}
+		default: {
+			uint64_t v = (uint64_t)value;
+			memcpy(p, &v, sizeof(v));
+			break;
+		}
+	}
+}
+
+/// Grow a bounding box to cover all overlays.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void overlay_extend_bounds(funge_vector * restrict min, funge_vector * restrict max)
+{
+	for (size_t i = 0; i < overlayCount; i++) {
+		const fungeRect * rect = &overlays[i].rect;
+		if (min->x > rect->x) min->x = rect->x;
+		if (min->y > rect->y) min->y = rect->y;
+		if (max->x < rect->x + rect->w - 1) max->x = rect->x + rect->w - 1;
+		if (max->y < rect->y + rect->h - 1) max->y = rect->y + rect->h - 1;
+	}
+}
+
+/// Tell those who care that the cells of a rectangle changed.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void overlay_notify(const fungeRect * restrict rect)
+{
+	funge_vector min = { rect->x, rect->y };
+	funge_vector max = { rect->x + rect->w - 1, rect->y + rect->h - 1 };
+	strcache_notify_area(&min, &max);
+#ifdef SPINWAIT_PARKING
+	if (FUNGE_UNLIKELY(spinwait_watcher_count != 0))
+		spinwait_notify_area(&min, &max);
+#endif
+}
+
+FUNGE_ATTR_FAST bool
+fungespace_attach(const fungeRect * restrict rect, void * data,
+                  size_t elementSize, bool isSigned)
+{
+	fungeOverlay * newOverlays;
+
+	if (rect->w <= 0 || rect->h <= 0
+	    || rect->x > FUNGECELL_MAX - (rect->w - 1) || rect->y > FUNGECELL_MAX - (rect->h - 1))
+		return false;
+	if (elementSize != 1 && elementSize != 2 && elementSize != 4 && elementSize != 8)
+		return false;
+	newOverlays = realloc(overlays, (overlayCount + 1) * sizeof(fungeOverlay));
+	if (FUNGE_UNLIKELY(!newOverlays))
+		return false;
+	overlays = newOverlays;
+	overlays[overlayCount].rect = *rect;
+	overlays[overlayCount].data = data;
+	overlays[overlayCount].elementSize = elementSize;
+	overlays[overlayCount].isSigned = isSigned;
+	// Parked IPs must see the cells as they were before.
+	overlay_notify(rect);
+	overlayCount++;
+	overlay_extend_bounds(&fspace.topLeftCorner, &fspace.bottomRightCorner);
+	return true;
+}
+
+FUNGE_ATTR_FAST bool
+fungespace_detach(const funge_vector * restrict position)
+{
+	fungeOverlay * overlay = overlay_find(position);
+	fungeRect rect;
+
+	if (!overlay)
+		return false;
+	rect = overlay->rect;
+	overlay_notify(&rect);
+	overlayCount--;
+	memmove(overlay, overlay + 1,
+	        (size_t)(overlays + overlayCount - overlay) * sizeof(fungeOverlay));
+	if (overlayCount == 0) {
+		free(overlays);
+		overlays = NULL;
+	}
+#ifdef CFUN_EXACT_BOUNDS
+	// The cells that show again are counted, the overlay isn't.
+	fspace.boundsexact = false;
+#endif
+	return true;
+}
+
+FUNGE_ATTR_FAST bool
+fungespace_is_native(const funge_vector * restrict position)
+{
+	return FUNGE_UNLIKELY(overlayCount != 0) && overlay_find(position);
+}
+
+
 /*********************************
  * Setup and teardown code here. *
  *********************************/
@@ -235,6 +560,10 @@ bool fungespace_create(void)
 
 void fungespace_free(void)
 {
+	layer_free_all();
+	free(overlays);
+	overlays = NULL;
+	overlayCount = 0;
 	if (fspace.entries)
 		ght_fspace_finalize(fspace.entries);
 #ifdef CFUN_EXACT_BOUNDS
@@ -368,6 +697,11 @@ static inline void fungespace_minimize_bounds(void)
 	fspace.topLeftCorner.y = miny;
 	fspace.bottomRightCorner.x = maxx;
 	fspace.bottomRightCorner.y = maxy;
+	// Mapped files aren't counted, assume they are still all there.
+	if (FUNGE_UNLIKELY(layerCount != 0))
+		layer_extend_bounds(&fspace.topLeftCorner, &fspace.bottomRightCorner);
+	if (FUNGE_UNLIKELY(overlayCount != 0))
+		overlay_extend_bounds(&fspace.topLeftCorner, &fspace.bottomRightCorner);
 	fspace.boundsexact = true;
 }
 
@@ -443,6 +777,14 @@ static inline void fungespace_count(bool isset, const funge_vector * restrict po
  * Code for checking Funge Space bounds in various ways *
  ********************************************************/
 
+#ifdef SPINWAIT_PARKING
+FUNGE_ATTR_FAST size_t
+fungespace_get_wrap_count(void)
+{
+	return fspace.wrapCount;
+}
+#endif
+
 FUNGE_ATTR_FAST void
 fungespace_get_bounds_rect(fungeRect * restrict rect)
 {
@@ -482,12 +824,17 @@ fungespace_get(const funge_vector * restrict position)
 	funge_unsigned_cell x = (funge_unsigned_cell)position->x + FUNGESPACE_STATIC_OFFSET_X;
 	funge_unsigned_cell y = (funge_unsigned_cell)position->y + FUNGESPACE_STATIC_OFFSET_Y;
 
+	if (FUNGE_UNLIKELY(overlayCount != 0)) {
+		const fungeOverlay * overlay = overlay_find(position);
+		if (overlay)
+			return overlay_get(overlay, position);
+	}
 	if (FUNGESPACE_RANGE_CHECK(x, y)) {
 		return cfun_static_space[STATIC_COORD(x, y)];
 	} else {
 		funge_cell *tmp = (funge_cell*)ght_fspace_get(fspace.entries, position);
 		if (!tmp)
-			return (funge_cell)' ';
+			return FUNGE_UNLIKELY(layerCount != 0) ? layer_get(position) : (funge_cell)' ';
 		else
 			return *tmp;
 	}
@@ -511,12 +858,17 @@ fungespace_get_offset(const funge_vector * restrict position,
 	x = (funge_unsigned_cell)tmp.x + FUNGESPACE_STATIC_OFFSET_X;
 	y = (funge_unsigned_cell)tmp.y + FUNGESPACE_STATIC_OFFSET_Y;
 
+	if (FUNGE_UNLIKELY(overlayCount != 0)) {
+		const fungeOverlay * overlay = overlay_find(&tmp);
+		if (overlay)
+			return overlay_get(overlay, &tmp);
+	}
 	if (FUNGESPACE_RANGE_CHECK(x, y)) {
 		return cfun_static_space[STATIC_COORD(x, y)];
 	} else {
 		result = (funge_cell*)ght_fspace_get(fspace.entries, &tmp);
 		if (!result)
-			return (funge_cell)' ';
+			return FUNGE_UNLIKELY(layerCount != 0) ? layer_get(&tmp) : (funge_cell)' ';
 		else
 			return *result;
 	}
@@ -535,6 +887,21 @@ fungespace_set_no_bounds_update(funge_cell value,
 	funge_unsigned_cell x = (funge_unsigned_cell)position->x + FUNGESPACE_STATIC_OFFSET_X;
 	funge_unsigned_cell y = (funge_unsigned_cell)position->y + FUNGESPACE_STATIC_OFFSET_Y;
 
+	if (FUNGE_UNLIKELY(strcache_may_contain(position)))
+		strcache_notify_write(position);
+#ifdef SPINWAIT_PARKING
+	// Wake IPs that wait for this cell before it changes.
+	if (FUNGE_UNLIKELY(spinwait_watcher_count != 0))
+		spinwait_notify_write(position);
+#endif
+
+	if (FUNGE_UNLIKELY(overlayCount != 0)) {
+		const fungeOverlay * overlay = overlay_find(position);
+		if (overlay) {
+			overlay_set(overlay, position, value);
+			return;
+		}
+	}
 	if (FUNGESPACE_RANGE_CHECK(x, y)) {
 #ifdef CFUN_EXACT_BOUNDS
 		funge_cell prev = cfun_static_space[STATIC_COORD(x, y)];
@@ -549,6 +916,10 @@ fungespace_set_no_bounds_update(funge_cell value,
 	} else {
 #ifdef CFUN_EXACT_BOUNDS
 		funge_cell* prev = ght_fspace_get(fspace.entries, position);
+#endif
+		if (FUNGE_UNLIKELY(layerCount != 0))
+			layer_mark_written(position);
+#ifdef CFUN_EXACT_BOUNDS
 		if (!prev) {
 			if (value == ' ')
 				return;
@@ -643,6 +1014,131 @@ fungespace_set_offset(funge_cell value,
 }
 
 
+/// Can a row of cells be accessed directly in the static array?
+#define STATIC_ROW_CHECK(m_sx, m_sy, m_length) \
+	(FUNGESPACE_RANGE_CHECK(m_sx, m_sy) && (m_length) <= FUNGESPACE_STATIC_X - (m_sx))
+
+/**
+ * Get a row of cells into either bytes or cells (the other one is NULL).
+ * Inlined into the callers, so checking which one is used costs nothing.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_ALWAYS_INLINE
+static inline void get_row(unsigned char * restrict bytes, funge_cell * restrict cells,
+                           size_t length, const funge_vector * restrict position)
+{
+	funge_unsigned_cell x = (funge_unsigned_cell)position->x + FUNGESPACE_STATIC_OFFSET_X;
+	funge_unsigned_cell y = (funge_unsigned_cell)position->y + FUNGESPACE_STATIC_OFFSET_Y;
+
+	if (overlayCount == 0 && STATIC_ROW_CHECK(x, y, length)) {
+		const funge_cell * restrict row = &cfun_static_space[STATIC_COORD(x, y)];
+		if (cells) {
+			memcpy(cells, row, length * sizeof(funge_cell));
+		} else {
+			for (size_t i = 0; i < length; i++)
+				bytes[i] = (unsigned char)row[i];
+		}
+	} else {
+		funge_vector pos = *position;
+		for (size_t i = 0; i < length; i++) {
+			funge_cell value;
+			pos.x = position->x + (funge_cell)i;
+			value = fungespace_get(&pos);
+			if (cells)
+				cells[i] = value;
+			else
+				bytes[i] = (unsigned char)value;
+		}
+	}
+}
+
+/// Set a row of cells from either bytes or cells, like get_row().
+FUNGE_ATTR_FAST FUNGE_ATTR_ALWAYS_INLINE
+static inline void set_row(const unsigned char * restrict bytes, const funge_cell * restrict cells,
+                           size_t length, const funge_vector * restrict position)
+{
+	funge_unsigned_cell x = (funge_unsigned_cell)position->x + FUNGESPACE_STATIC_OFFSET_X;
+	funge_unsigned_cell y = (funge_unsigned_cell)position->y + FUNGESPACE_STATIC_OFFSET_Y;
+	funge_vector pos = *position;
+
+	if (length == 0)
+		return;
+	// Rows in the static array are written directly, unless a cached string
+	// literal or a parked IP needs to know about the writes, or the row may
+	// be in native memory.
+	if (overlayCount == 0 && STATIC_ROW_CHECK(x, y, length)
+	    && !(position->y >= strcache_min.y && position->y <= strcache_max.y
+	         && position->x <= strcache_max.x
+	         && position->x + (funge_cell)(length - 1) >= strcache_min.x)
+#ifdef SPINWAIT_PARKING
+	    && spinwait_watcher_count == 0
+#endif
+	   ) {
+		funge_cell * restrict row = &cfun_static_space[STATIC_COORD(x, y)];
+		size_t first = length, last = 0;
+		for (size_t i = 0; i < length; i++) {
+			funge_cell value = cells ? cells[i] : bytes[i];
+#ifdef CFUN_EXACT_BOUNDS
+			if ((row[i] == ' ') != (value == ' ')) {
+				pos.x = position->x + (funge_cell)i;
+				fungespace_count((value != ' '), &pos);
+			}
+#endif
+			row[i] = value;
+			if (value != ' ') {
+				if (first == length)
+					first = i;
+				last = i;
+			}
+		}
+		if (first != length) {
+			funge_cell firstx = position->x + (funge_cell)first;
+			funge_cell lastx  = position->x + (funge_cell)last;
+			if (fspace.bottomRightCorner.y < position->y)
+				fspace.bottomRightCorner.y = position->y;
+			if (fspace.topLeftCorner.y > position->y)
+				fspace.topLeftCorner.y = position->y;
+			if (fspace.bottomRightCorner.x < lastx)
+				fspace.bottomRightCorner.x = lastx;
+			if (fspace.topLeftCorner.x > firstx)
+				fspace.topLeftCorner.x = firstx;
+		}
+	} else {
+		for (size_t i = 0; i < length; i++) {
+			pos.x = position->x + (funge_cell)i;
+			fungespace_set(cells ? cells[i] : bytes[i], &pos);
+		}
+	}
+}
+
+FUNGE_ATTR_FAST void
+fungespace_get_bytes(unsigned char * restrict data, size_t length,
+                     const funge_vector * restrict position)
+{
+	get_row(data, NULL, length, position);
+}
+
+FUNGE_ATTR_FAST void
+fungespace_set_bytes(const unsigned char * restrict data, size_t length,
+                     const funge_vector * restrict position)
+{
+	set_row(data, NULL, length, position);
+}
+
+FUNGE_ATTR_FAST void
+fungespace_get_cells(funge_cell * restrict data, size_t length,
+                     const funge_vector * restrict position)
+{
+	get_row(NULL, data, length, position);
+}
+
+FUNGE_ATTR_FAST void
+fungespace_set_cells(const funge_cell * restrict data, size_t length,
+                     const funge_vector * restrict position)
+{
+	set_row(NULL, data, length, position);
+}
+
+
 /*****************
  * Wrapping code *
  *****************/
@@ -715,6 +1211,9 @@ fungespace_wrap(funge_vector * restrict position,
 		fungespace_minimize_bounds();
 #endif
 	if (!fungespace_in_range(position)) {
+#ifdef SPINWAIT_PARKING
+		fspace.wrapCount++;
+#endif
 		// Quick and dirty if cardinal.
 		if (FUNGE_LIKELY(fspace_vector_is_cardinal(delta))) {
 			// FIXME, HACK: Why are the +1/-1 needed?
@@ -984,6 +1483,210 @@ fungespace_load_at_offset(const char         * restrict filename,
 	return true;
 }
 
+/**
+ * Find where the lines of a text file start, for a layer.
+ * @return False if the file can't be mapped lazily (it contains form feeds,
+ *         which don't take up a cell) or on out of memory.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool layer_index_lines(fungeLayer * restrict layer)
+{
+	const unsigned char * data = layer->data;
+	size_t allocated = 1024;
+	size_t rows = 0;
+	size_t start = 0;
+
+	// Kept in the layer while growing, so a failed realloc() leaves a single
+	// pointer to free.
+	layer->lineStarts = malloc(allocated * sizeof(size_t));
+	if (FUNGE_UNLIKELY(!layer->lineStarts))
+		return false;
+	layer->width = 0;
+	for (size_t i = 0; i <= layer->length; i++) {
+		size_t next;
+		if (i == layer->length) {
+			next = i;
+		} else if (data[i] == '\n') {
+			next = i + 1;
+		} else if (data[i] == '\r') {
+			next = (i + 1 < layer->length && data[i + 1] == '\n') ? i + 2 : i + 1;
+		} else if (data[i] == '\f') {
+			goto error;
+		} else {
+			continue;
+		}
+		if (rows == allocated) {
+			size_t * newLines;
+			allocated *= 2;
+			newLines = realloc(layer->lineStarts, allocated * sizeof(size_t));
+			if (FUNGE_UNLIKELY(!newLines))
+				goto error;
+			layer->lineStarts = newLines;
+		}
+		if (i - start > (size_t)layer->width)
+			layer->width = (funge_cell)(i - start);
+		// No line after the last line ending.
+		if (i == layer->length && start == i && rows != 0)
+			break;
+		layer->lineStarts[rows++] = start;
+		if (i == layer->length)
+			break;
+		start = next;
+		i = next - 1;
+	}
+	layer->rows = rows;
+	return true;
+error:
+	free(layer->lineStarts);
+	layer->lineStarts = NULL;
+	return false;
+}
+
+/**
+ * Hash table entries that a new layer covers with non-space cells are
+ * removed, so the layer shows like i would have written it.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void layer_clear_covered(const fungeLayer * restrict layer)
+{
+	ght_fspace_iterator_t iterator;
+	const funge_vector *p_key;
+	funge_cell *p;
+	funge_vector * covered = NULL;
+	size_t count = 0, allocated = 0;
+
+	// Can't remove while iterating.
+	for (p = ght_fspace_first(fspace.entries, &iterator, &p_key);
+	     p; p = ght_fspace_next(&iterator, &p_key)) {
+		size_t index;
+		if (!layer_index(layer, p_key, &index) || layer->data[index] == ' ')
+			continue;
+		if (count == allocated) {
+			funge_vector * newCovered;
+			allocated = allocated ? allocated * 2 : 64;
+			newCovered = realloc(covered, allocated * sizeof(funge_vector));
+			if (FUNGE_UNLIKELY(!newCovered))
+				DIAG_OOM("Could not allocate memory for mapping file");
+			covered = newCovered;
+		}
+		covered[count++] = *p_key;
+	}
+	for (size_t i = 0; i < count; i++)
+		fungespace_set_no_bounds_update(' ', &covered[i]);
+	free(covered);
+}
+
+/**
+ * Load the part of a layer that is in the static array, which the layer
+ * itself isn't consulted for.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void layer_load_static(const fungeLayer * restrict layer)
+{
+	funge_cell minx = -FUNGESPACE_STATIC_OFFSET_X;
+	funge_cell miny = -FUNGESPACE_STATIC_OFFSET_Y;
+	funge_cell maxx = FUNGESPACE_STATIC_X - FUNGESPACE_STATIC_OFFSET_X - 1;
+	funge_cell maxy = FUNGESPACE_STATIC_Y - FUNGESPACE_STATIC_OFFSET_Y - 1;
+	funge_vector pos;
+
+	if (layer->offset.x > minx) minx = layer->offset.x;
+	if (layer->offset.y > miny) miny = layer->offset.y;
+	if (layer->offset.x + layer->width - 1 < maxx) maxx = layer->offset.x + layer->width - 1;
+	if (layer->offset.y + (funge_cell)layer->rows - 1 < maxy) maxy = layer->offset.y + (funge_cell)layer->rows - 1;
+
+	for (pos.y = miny; pos.y <= maxy; pos.y++) {
+		for (pos.x = minx; pos.x <= maxx; pos.x++) {
+			size_t index;
+			if (!layer_index(layer, &pos, &index))
+				break;
+			if (layer->data[index] != ' ')
+				fungespace_set((funge_cell)layer->data[index], &pos);
+		}
+	}
+}
+
+FUNGE_ATTR_FAST bool
+fungespace_map_at_offset(const char         * restrict filename,
+                         const funge_vector * restrict offset,
+                         funge_vector       * restrict size,
+                         bool binary)
+{
+	fungeLayer layer;
+	fungeLayer * newLayers;
+	funge_vector max;
+	int fd;
+
+	assert(filename != NULL);
+	assert(offset != NULL);
+	assert(size != NULL);
+
+	fd = do_mmap(filename, &layer.data, &layer.length);
+	if (FUNGE_UNLIKELY(fd == -1))
+		return false;
+	if (FUNGE_UNLIKELY(fd == -2)) {
+		size->x = 0;
+		size->y = 0;
+		return true;
+	}
+	// The mapping stays valid after the file is closed.
+	close(fd);
+#if defined(_POSIX_ADVISORY_INFO) && (_POSIX_ADVISORY_INFO > 0)
+	posix_madvise(layer.data, layer.length, POSIX_MADV_RANDOM);
+#endif
+
+	layer.offset = *offset;
+	layer.lineStarts = NULL;
+	layer.written = NULL;
+	if (binary) {
+		layer.width = (funge_cell)layer.length;
+		layer.rows = 1;
+		if (layer.length > (size_t)FUNGECELL_MAX)
+			goto load;
+	} else if (!layer_index_lines(&layer)) {
+		goto load;
+	}
+	layer.written = calloc(layer.length / 8 + 1, 1);
+	newLayers = realloc(layers, (layerCount + 1) * sizeof(fungeLayer));
+	if (FUNGE_UNLIKELY(!layer.written || !newLayers)) {
+		if (newLayers)
+			layers = newLayers;
+		goto load;
+	}
+	layers = newLayers;
+
+	// The cells change without fungespace_set(), so tell those who care.
+	max.x = layer.offset.x + layer.width - 1;
+	max.y = layer.offset.y + (funge_cell)layer.rows - 1;
+	strcache_notify_area(&layer.offset, &max);
+#ifdef SPINWAIT_PARKING
+	if (FUNGE_UNLIKELY(spinwait_watcher_count != 0))
+		spinwait_notify_area(&layer.offset, &max);
+#endif
+	layer_clear_covered(&layer);
+	layer_load_static(&layer);
+	layers[layerCount++] = layer;
+	layer_extend_bounds(&fspace.topLeftCorner, &fspace.bottomRightCorner);
+
+	// Same size as fungespace_load_at_offset() reports.
+	if (binary) {
+		funge_cell end = offset->x + (funge_cell)layer.length;
+		size->x = end > 0 ? end : 0;
+		size->y = offset->y > 0 ? offset->y : 0;
+	} else {
+		unsigned char last = layer.data[layer.length - 1];
+		size->x = layer.width;
+		size->y = (funge_cell)layer.rows - ((last == '\n' || last == '\r') ? 0 : 1);
+	}
+	return true;
+
+	// Files that can't be mapped lazily are loaded the normal way.
+load:
+	free(layer.lineStarts);
+	free(layer.written);
+	munmap(layer.data, layer.length);
+	return fungespace_load_at_offset(filename, offset, size, binary);
+}
+
 FUNGE_ATTR_FAST bool
 fungespace_save_to_file(const char         * restrict filename,
                         const funge_vector * restrict offset,
@@ -83,6 +83,45 @@ FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
 void fungespace_set_offset(funge_cell value,
                            const funge_vector * restrict position,
                            const funge_vector * restrict offset);
+/**
+ * Get a row of cells as bytes (each cell truncated to unsigned char), going
+ * east from position. Used for I/O buffers in Funge-Space.
+ * @param data Buffer for the bytes.
+ * @param length Number of cells to get.
+ * @param position First cell.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void fungespace_get_bytes(unsigned char * restrict data, size_t length,
+                          const funge_vector * restrict position);
+/**
+ * Set a row of cells from bytes, going east from position. Same result as
+ * calling fungespace_set() for each byte, but faster.
+ * @param data The bytes to store, one per cell.
+ * @param length Number of bytes.
+ * @param position First cell.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void fungespace_set_bytes(const unsigned char * restrict data, size_t length,
+                          const funge_vector * restrict position);
+/**
+ * Get a row of cells, going east from position.
+ * @param data Buffer for the cells.
+ * @param length Number of cells to get.
+ * @param position First cell.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void fungespace_get_cells(funge_cell * restrict data, size_t length,
+                          const funge_vector * restrict position);
+/**
+ * Set a row of cells, going east from position. Same result as calling
+ * fungespace_set() for each cell, but faster.
+ * @param data The cells to store.
+ * @param length Number of cells.
+ * @param position First cell.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void fungespace_set_cells(const funge_cell * restrict data, size_t length,
+                          const funge_vector * restrict position);
 /**
  * Calculate the new position after adding a delta to a position, considering
  * any needed wrapping. Used for IP wrapping.
@@ -132,6 +171,50 @@ bool fungespace_load_at_offset(const char * restrict filename,
                                const funge_vector * restrict offset,
                                funge_vector * restrict size,
                                bool binary);
+/**
+ * Like fungespace_load_at_offset(), but the file is mapped and its cells are
+ * read when used instead of being copied into Funge-Space. Cells written
+ * later replace the file's cells as usual, the file itself is never changed.
+ * Used for i with flag 2 (a cfunge extension). Files that can't be mapped
+ * this way (text files with form feeds) are loaded normally.
+ * @param filename Filename to map.
+ * @param offset The offset to map the file at.
+ * @param size Filled in like for fungespace_load_at_offset().
+ * @param binary If true the whole file is one line.
+ * @return True if successful, otherwise false.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool fungespace_map_at_offset(const char * restrict filename,
+                              const funge_vector * restrict offset,
+                              funge_vector * restrict size,
+                              bool binary);
+/**
+ * Show native memory as a rectangle of Funge-Space: g, p and everything else
+ * read and write the memory directly for cells inside it. Overlays hide what
+ * was in Funge-Space there until they are detached, newer ones hide older
+ * ones. Used by CFFI.
+ * @param rect Where, width and height must be positive.
+ * @param data Memory with one element per cell, row after row. Must stay
+ *             valid until detached.
+ * @param elementSize Size of the elements: 1, 2, 4 or 8 bytes.
+ * @param isSigned Sign extend elements narrower than a cell.
+ * @return False if the arguments are invalid or if out of memory.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool fungespace_attach(const fungeRect * restrict rect, void * data,
+                       size_t elementSize, bool isSigned);
+/**
+ * Detach the newest overlay that covers a cell.
+ * @return False if no overlay covers it.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+bool fungespace_detach(const funge_vector * restrict position);
+/**
+ * Check if a cell is in an overlay. Those can change without
+ * fungespace_set() being called, so they must not be cached.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool fungespace_is_native(const funge_vector * restrict position);
 /**
  * Write out a file from an area of Funge-Space at an offset. Used for the o
  * instruction.
@@ -156,4 +239,13 @@ bool fungespace_save_to_file(const char         * restrict filename,
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
 void fungespace_get_bounds_rect(fungeRect * restrict rect);
 
+#ifdef SPINWAIT_PARKING
+/**
+ * Get the number of times fungespace_wrap() had to wrap a position.
+ * Used by the spin-wait detection to find cycles that depend on the bounds.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+size_t fungespace_get_wrap_count(void);
+#endif
+
 #endif
@@ -21,153 +21,374 @@
 
 #include "global.h"
 #include "input.h"
+#include "output.h"
 
 #include <assert.h>
-#include <ctype.h>  /* isdigit, isxdigit */
+#include <ctype.h>  /* isxdigit */
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h> /* ptrdiff_t */
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h> /* memchr, memcpy, memmove */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h> /* read, lseek */
 
-// We use static buffer for input to save input
-// from one read to the next if there was any
-// left.
-static char*  lastline = NULL;
-// Size of buffer, may be grown by cf_getline()
-static size_t linesize = 0;
-// Length of current string in buffer. Needed in case of \0 bytes in it
-static size_t linelength = 0;
-// Pointer to how far we consumed the current line.
-static char*  lastline_current = NULL;
+#ifdef IO_EVENT_LOOP
+#  include <poll.h>
+#endif
 
-#define IS_LINE_END(ptr) ((size_t)((ptr)-lastline) >= linelength)
+/*
+ * Input is read from STDIN in large blocks into a buffer that is kept between
+ * calls (or, if STDIN is a regular file, the file is mmap()ed). Instructions
+ * still consume input one line at a time: a line is only used once it is
+ * complete (or at EOF), exactly like when it was read with getline().
+ */
+
+/// Size of the first block read, the buffer grows if a line is longer.
+#define INPUT_BLOCK_SIZE (64 * 1024)
+
+// The buffer: malloc()ed, or a mapping of STDIN if input_mapped is true.
+static char*  input_buffer = NULL;
+// Size of buffer (or mapping).
+static size_t input_size = 0;
+// Offset of the mapping from the start of the page it starts on.
+static size_t input_map_offset = 0;
+// Index of first unconsumed char.
+static size_t input_pos = 0;
+// Index just after the end of the current line (0 if there is none).
+static size_t input_line_end = 0;
+// Index just after the last valid char in the buffer.
+static size_t input_end = 0;
+// Is input_buffer a mapping of STDIN?
+static bool   input_mapped = false;
+// Have we tried to map STDIN yet?
+static bool   input_setup_done = false;
+#ifdef IO_EVENT_LOOP
+// Did input_ready() get EOF? Then the next read_more() must not read again,
+// as a terminal would wait for more input after an EOF.
+static bool   input_eof_pending = false;
+#endif
+
+/// Try to mmap() STDIN if it is a regular file.
+FUNGE_ATTR_FAST
+static void input_setup(void)
+{
+	struct stat st;
+	off_t offset, aligned;
+	long pagesize;
+	void * map;
+
+	input_setup_done = true;
+	if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+	offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	pagesize = sysconf(_SC_PAGESIZE);
+	if (offset < 0 || pagesize <= 0 || offset >= st.st_size)
+		return;
+	aligned = offset - (offset % pagesize);
+	map = mmap(NULL, (size_t)(st.st_size - aligned), PROT_READ, MAP_PRIVATE,
+	           STDIN_FILENO, aligned);
+	if (map == MAP_FAILED)
+		return;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, (size_t)(st.st_size - aligned), MADV_SEQUENTIAL);
+#endif
+	// Anything appended later is read normally once the mapping is used up.
+	if (lseek(STDIN_FILENO, st.st_size, SEEK_SET) < 0) {
+		munmap(map, (size_t)(st.st_size - aligned));
+		return;
+	}
+	input_buffer     = map;
+	input_size       = (size_t)(st.st_size - aligned);
+	input_map_offset = (size_t)(offset - aligned);
+	input_pos        = input_map_offset;
+	input_end        = input_size;
+	input_mapped     = true;
+}
+
+/**
+ * Read more input into the buffer, keeping unconsumed data.
+ * @return False on EOF or error.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static bool read_more(void)
+{
+	size_t  pending = input_end - input_pos;
+	ssize_t retval;
+
+	if (input_mapped) {
+		// Switch to a normal buffer, keeping what is left of the mapping.
+		size_t size = INPUT_BLOCK_SIZE;
+		char * buffer;
+		while (size <= pending)
+			size *= 2;
+		buffer = (char*)malloc(size);
+		if (FUNGE_UNLIKELY(!buffer))
+			return false;
+		memcpy(buffer, input_buffer + input_pos, pending);
+		munmap(input_buffer, input_size);
+		input_buffer = buffer;
+		input_size   = size;
+		input_mapped = false;
+	} else if (input_pos != 0) {
+		// Move the unconsumed part (at most one partial line) to the front.
+		if (pending != 0)
+			memmove(input_buffer, input_buffer + input_pos, pending);
+	} else if (input_end == input_size) {
+		size_t size = input_size ? input_size * 2 : INPUT_BLOCK_SIZE;
+		char * buffer = (char*)realloc(input_buffer, size);
+		if (FUNGE_UNLIKELY(!buffer))
+			return false;
+		input_buffer = buffer;
+		input_size   = size;
+	}
+	input_pos = 0;
+	input_end = pending;
 
+#ifdef IO_EVENT_LOOP
+	if (FUNGE_UNLIKELY(input_eof_pending)) {
+		input_eof_pending = false;
+		return false;
+	}
+#endif
+	// We are about to wait for input, make sure any prompt is visible.
+	output_flush_for_input();
+	do {
+		retval = read(STDIN_FILENO, input_buffer + input_end, input_size - input_end);
+	} while (retval == -1 && errno == EINTR);
+	if (retval <= 0)
+		return false;
+	input_end += (size_t)retval;
+	return true;
+}
+
+/**
+ * Make sure there is a complete line with unconsumed chars in it.
+ * @return False on EOF (with nothing left).
+ */
 FUNGE_ATTR_WARN_UNUSED
 static inline bool get_line(void)
 {
-	if (!lastline || !lastline_current || IS_LINE_END(lastline_current)) {
-		ssize_t retval;
-		fflush(stdout);
-		retval = cf_getline(&lastline, &linesize, stdin);
-		if (retval == -1)
+	size_t searched;
+	const char * newline;
+
+	if (FUNGE_LIKELY(input_pos < input_line_end))
+		return true;
+	if (FUNGE_UNLIKELY(!input_setup_done))
+		input_setup();
+
+	searched = input_pos;
+	for (;;) {
+		newline = (const char*)memchr(input_buffer + searched, '\n', input_end - searched);
+		if (newline) {
+			input_line_end = (size_t)(newline - input_buffer) + 1;
+			return true;
+		}
+		// All of it has been searched. read_more() moves it to the start of
+		// the buffer.
+		searched = input_end - input_pos;
+		if (!read_more())
+			break;
+	}
+	// EOF: use what is left as the last line (without newline).
+	if (input_pos < input_end) {
+		input_line_end = input_end;
+		return true;
+	}
+	input_line_end = 0;
+	return false;
+}
+
+#ifdef IO_EVENT_LOOP
+FUNGE_ATTR_FAST bool input_ready(void)
+{
+	if (FUNGE_LIKELY(input_pos < input_line_end))
+		return true;
+	if (FUNGE_UNLIKELY(!input_setup_done))
+		input_setup();
+
+	for (;;) {
+		struct pollfd pfd;
+		int retval;
+
+		if (input_pos < input_end
+		    && memchr(input_buffer + input_pos, '\n', input_end - input_pos))
+			return true;
+		pfd.fd      = STDIN_FILENO;
+		pfd.events  = POLLIN;
+		pfd.revents = 0;
+		do {
+			retval = poll(&pfd, 1, 0);
+		} while (retval == -1 && errno == EINTR);
+		if (retval == 0)
 			return false;
-		lastline_current = lastline;
-		linelength = retval;
+		// Can't block now, there is something to read (or an error to get).
+		if (!read_more()) {
+			input_eof_pending = true;
+			return true;
+		}
 	}
-	return true;
 }
+#endif
 
+/// Throw away the rest of the current line.
 static inline void discard_line(void)
 {
-	if (lastline != NULL)
-		free(lastline);
-	lastline = NULL;
-	linelength = 0;
-	linesize = 0;
-	lastline_current = NULL;
+	input_pos = input_line_end;
 }
 
 
 FUNGE_ATTR_FAST bool input_getchar(funge_cell * restrict chr)
 {
-	unsigned char tmp;
 	if (!get_line())
 		return false;
-	tmp = *((unsigned char*)lastline_current);
-	lastline_current++;
-	if (lastline_current && IS_LINE_END(lastline_current))
-		discard_line();
-	*chr = (funge_cell)tmp;
+	*chr = (funge_cell)(unsigned char)input_buffer[input_pos++];
 	return true;
 }
 
 FUNGE_ATTR_FAST bool input_getline(unsigned char ** str)
 {
+	size_t length;
+	unsigned char * line;
+
 	if (!get_line())
 		return false;
+	length = input_line_end - input_pos;
+	line = (unsigned char*)malloc(length + 1);
+	if (FUNGE_UNLIKELY(!line))
+		return false;
+	memcpy(line, input_buffer + input_pos, length);
 	// TODO: How to handle zero bytes?
-	*str = (unsigned char*)strdup(lastline_current);
+	line[length] = '\0';
+	*str = line;
 	discard_line();
 	return true;
 }
 
 
-static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+/// Value of the digit c, or 36 if it isn't one (same as digits used to).
+FUNGE_ATTR_FAST FUNGE_ATTR_CONST FUNGE_ATTR_WARN_UNUSED
+static inline funge_cell digit_value(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 10;
+	return 36;
+}
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+/// Can parse_eight_digits() be used?
+#  define INPUT_SWAR_DIGITS
+/**
+ * Convert eight ASCII decimal digits in one go (SWAR: the eight bytes are
+ * combined pairwise in a 64-bit register, three multiplications in total).
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline uint32_t parse_eight_digits(const char * restrict s)
+{
+	uint64_t val;
+	memcpy(&val, s, sizeof(val));
+	val = ((val & UINT64_C(0x0F0F0F0F0F0F0F0F)) * 2561) >> 8;
+	val = ((val & UINT64_C(0x00FF00FF00FF00FF)) * 6553601) >> 16;
+	return (uint32_t)(((val & UINT64_C(0x0000FFFF0000FFFF)) * UINT64_C(42949672960001)) >> 32);
+}
+#endif
+
+/// Number of decimal digits that always fit in a funge_cell.
+#ifdef USE64
+#  define SAFE_DIGITS 18
+#else
+#  define SAFE_DIGITS 9
+#endif
 
 // Start of s as if it is in base.
 // Unlike strtoll this does not clamp on overflow but stop reading just before
 // a overflow would happen.
 // Converted value is returned in *value.
-// Return value is last index used in string.
+// Return value is number of chars used.
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
 static inline ptrdiff_t parse_int(const char * restrict s,
+                                  const char * restrict end,
                                   funge_cell * restrict value,
-                                  funge_cell base,
-                                  const size_t length)
+                                  funge_cell base)
 {
 	funge_cell result = 0;
-	size_t i;
+	const char * p = s;
 
 	assert(s != NULL);
 	assert(value != NULL);
 
-	for (i = 0; i <= length; i++) {
+	if (base == 10) {
+		// Short enough runs of digits can't overflow, so convert those
+		// without any checks, eight digits at a time when possible.
+		const char * run = s;
+		while (run < end && (size_t)(run - s) <= SAFE_DIGITS
+		       && *run >= '0' && *run <= '9')
+			run++;
+		if ((size_t)(run - s) <= SAFE_DIGITS) {
+#ifdef INPUT_SWAR_DIGITS
+			for (; run - p >= 8; p += 8)
+				result = result * 100000000 + (funge_cell)parse_eight_digits(p);
+#endif
+			for (; p < run; p++)
+				result = result * 10 + (*p - '0');
+			*value = result;
+			return run - s;
+		}
+	}
+
+	for (; p < end; p++) {
+		funge_cell tmp;
 		// Will it overflow?
 		if (result > (FUNGECELL_MAX / base))
 			break;
-		{
-			funge_cell tmp;
-			char c = s[i];
-			// Pointer into digits.
-			const char *p = strchr(digits, c);
-			// Still a digit?
-			if (!p || ((p - digits) >= (ptrdiff_t) base))
-				break;
-
-			tmp = (funge_cell) (p - digits);
-			// Break if it will overflow!
-			if ((result * base) > (FUNGECELL_MAX - tmp))
-				break;
-			result = (result * base) + tmp;
-		}
+		tmp = digit_value((unsigned char)*p);
+		// Still a digit?
+		if (tmp >= base)
+			break;
+		// Break if it will overflow!
+		if ((result * base) > (FUNGECELL_MAX - tmp))
+			break;
+		result = (result * base) + tmp;
 	}
 	*value = result;
-	return (ptrdiff_t)i;
+	return p - s;
 }
 
-// Note, no need to optimise really, this is user input
-// bound anyway.
 FUNGE_ATTR_FAST ret_getint input_getint(funge_cell * restrict value, int base)
 {
-	bool found = false;
-	char * endptr = NULL;
+	const char * p;
+	const char * end;
+	const char * endptr;
 	assert(value != NULL);
 
 	if (!get_line())
 		return rgi_eof;
-	// Find first char that is a number, then convert number.
-	do {
-		if (base == 10) {
-			if (!isdigit(*lastline_current))
-				continue;
-		} else if (base == 16) {
-			if (!isxdigit(*lastline_current))
-				continue;
-		} else {
-			const char * p = strchr(digits, *lastline_current);
-			if (!p || ((p - digits) >= (ptrdiff_t)base))
-				continue;
-		}
-		found = true;
-		// Ok, we found it, lets convert it.
-		endptr = lastline_current
-		         + parse_int(lastline_current, value, (funge_cell)base,
-		                     lastline_current - lastline + linelength);
-		break;
-	} while ((size_t)((lastline_current++) - lastline) < linelength);
+	p   = input_buffer + input_pos;
+	end = input_buffer + input_line_end;
+	// Find first char that is a number. For base 16 this has always
+	// accepted upper case too (which then converts as 0).
+	if (base == 16) {
+		while (p < end && !isxdigit((unsigned char)*p))
+			p++;
+	} else {
+		while (p < end && digit_value((unsigned char)*p) >= base)
+			p++;
+	}
+	if (p == end) {
+		// No number on this line.
+		discard_line();
+		return rgi_noint;
+	}
+	// Ok, we found it, lets convert it.
+	endptr = p + parse_int(p, end, value, (funge_cell)base);
 	// Discard rest of line if it is just newline, otherwise keep it.
-	if (endptr && ((*endptr == '\n') || (*endptr == '\r') || IS_LINE_END(endptr)))
+	if (endptr == end || (*endptr == '\n') || (*endptr == '\r'))
 		discard_line();
 	else
-		lastline_current = endptr;
-	return found ? rgi_success : rgi_noint;
+		input_pos = (size_t)(endptr - input_buffer);
+	return rgi_success;
 }
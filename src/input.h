@@ -71,4 +71,15 @@ bool input_getchar(funge_cell * restrict chr);
 FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED FUNGE_ATTR_FAST
 bool input_getline(unsigned char ** str);
 
+#ifdef IO_EVENT_LOOP
+/**
+ * Check if the next input instruction can run without waiting: a complete
+ * line (or EOF) is buffered. Reads whatever STDIN has available, without
+ * blocking.
+ * @return False if the input instruction would have to wait.
+ */
+FUNGE_ATTR_WARN_UNUSED FUNGE_ATTR_FAST
+bool input_ready(void);
+#endif
+
 #endif
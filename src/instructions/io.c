@@ -42,7 +42,8 @@ FUNGE_ATTR_FAST void run_file_input(instructionPointer * restrict ip)
 
 	{
 		char * restrict filename;
-		bool binary;
+		funge_cell flags;
+		bool binary, loaded;
 		funge_vector offset;
 		funge_vector size;
 
@@ -56,12 +57,20 @@ FUNGE_ATTR_FAST void run_file_input(instructionPointer * restrict ip)
 			return;
 		}
 
-		binary = (bool)(stack_pop(ip->stack) & 1);
+		flags = stack_pop(ip->stack);
+		binary = (bool)(flags & 1);
 		offset = stack_pop_vector(ip->stack);
 
-		if (!fungespace_load_at_offset(filename,
-		                               vector_create_ref(offset.x + ip->storageOffset.x, offset.y + ip->storageOffset.y),
-		                               &size, binary)) {
+		// Flag 2 (cfunge extension): map the file, read cells when used.
+		if (flags & 2)
+			loaded = fungespace_map_at_offset(filename,
+			                                  vector_create_ref(offset.x + ip->storageOffset.x, offset.y + ip->storageOffset.y),
+			                                  &size, binary);
+		else
+			loaded = fungespace_load_at_offset(filename,
+			                                   vector_create_ref(offset.x + ip->storageOffset.x, offset.y + ip->storageOffset.y),
+			                                   &size, binary);
+		if (!loaded) {
 			ip_reverse(ip);
 		} else {
 			stack_push_vector(ip->stack, &size);
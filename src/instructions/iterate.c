@@ -27,6 +27,7 @@
 #include "../stack.h"
 #include "../ip.h"
 #include "../settings.h"
+#include "../ioloop.h"
 
 #ifdef AFL_FUZZ_TESTING
 #  ifdef CONCURRENT_FUNGE
@@ -81,6 +82,73 @@ static inline funge_cell find_next_instr(instructionPointer * restrict ip, funge
 	return kInstr;
 }
 
+/**
+ * Run all iterations at once for instructions where that is simple.
+ * @param ip Instruction pointer to operate on.
+ * @param kInstr Instruction to iterate.
+ * @param iters Number of iterations, must be positive.
+ * @return True if done, false if the instruction needs to be executed one
+ *         iteration at a time.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static inline bool run_iterate_bulk(instructionPointer * restrict ip, funge_cell kInstr, funge_cell iters)
+{
+	switch (kInstr) {
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			stack_push_repeated(ip->stack, kInstr - '0', (size_t)iters);
+			return true;
+		case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+			stack_push_repeated(ip->stack, kInstr - 'a' + 0xa, (size_t)iters);
+			return true;
+		case ':':
+			// The first : on an empty stack pushes two zeros.
+			if (ip->stack->top == 0)
+				iters++;
+			stack_push_repeated(ip->stack, stack_peek(ip->stack), (size_t)iters);
+			return true;
+		case '$':
+			stack_discard(ip->stack, (size_t)iters);
+			return true;
+		case 'n':
+			stack_clear(ip->stack);
+			stack_trim(ip->stack);
+			return true;
+		case '#':
+			// Each step may wrap, so no shortcut for the movement itself.
+			while (iters--)
+				ip_forward(ip);
+			return true;
+		// These only depend on the parity or are idempotent.
+		case '^':
+			ip_go_north(ip);
+			return true;
+		case '>':
+			ip_go_east(ip);
+			return true;
+		case 'v':
+			ip_go_south(ip);
+			return true;
+		case '<':
+			ip_go_west(ip);
+			return true;
+		case 'r':
+			if (iters & 1)
+				ip_reverse(ip);
+			return true;
+		case '[':
+			for (iters &= 3; iters > 0; iters--)
+				ip_turn_left(ip);
+			return true;
+		case ']':
+			for (iters &= 3; iters > 0; iters--)
+				ip_turn_right(ip);
+			return true;
+		default:
+			return false;
+	}
+}
+
 /**
  * Implements the k instruction, prototype differ depending on if
  * CONCURRENT_FUNGE is defined.
@@ -173,6 +241,20 @@ static FUNGE_ATTR_FAST void run_iterate_implement(instructionPointer * restrict
 #ifdef CONCURRENT_FUNGE
 				ssize_t oldindex = *threadindex;
 #endif
+#ifdef IO_EVENT_LOOP
+				// A parked IP would run k again when woken, but the count is
+				// popped already. So block like a lone IP instead.
+				bool wasAlone = ioloop_alone;
+				ioloop_alone = true;
+#endif
+				// Tracing wants to see each iteration.
+#ifndef DISABLE_TRACE
+				if (FUNGE_LIKELY(setting_trace_level <= 5))
+#endif
+				{
+					if (run_iterate_bulk(ip, kInstr, iters))
+						iters = 0;
+				}
 				while (iters--) {
 #ifndef DISABLE_TRACE
 					print_trace(iters, kInstr);
@@ -213,6 +295,9 @@ static FUNGE_ATTR_FAST void run_iterate_implement(instructionPointer * restrict
 							break;
 					}
 				}
+#ifdef IO_EVENT_LOOP
+				ioloop_alone = wasAlone;
+#endif
 #if defined(CONCURRENT_FUNGE) && defined(LARGE_IPLIST)
 				if (kInstr == 't')
 					ip = (*IPList)->ips[oldindex];
@@ -27,12 +27,20 @@
 #include "funge-space/funge-space.h"
 #include "input.h"
 #include "ip.h"
+#include "output.h"
 #include "prng.h"
 #include "settings.h"
 #include "stack.h"
+#include "strcache.h"
 #include "vector.h"
 
 #include "fingerprints/manager.h"
+#ifdef SPINWAIT_PARKING
+#  include "spinwait.h"
+#endif
+#ifdef IO_EVENT_LOOP
+#  include "ioloop.h"
+#endif
 
 #include "instructions/execute.h"
 #include "instructions/io.h"
@@ -44,6 +52,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> /* strerror */
+#include <unistd.h> /* STDIN_FILENO */
 
 #ifdef HAVE_clock_gettime
 #  include <time.h>
@@ -67,6 +76,9 @@ static instructionPointer *IP = NULL;
 #endif
 /*@}*/
 
+/// How many interpreter_run_nested() calls are active.
+static size_t nesting = 0;
+
 /**
  * Print warning on unknown instruction if such warnings are enabled.
  */
@@ -144,11 +156,10 @@ static inline void handle_fprint(funge_cell opcode, instructionPointer * restric
 		warn_unknown_instr(opcode, ip);
 		ip_reverse(ip);
 	} else {
-		int_fast8_t entry = (int_fast8_t)(opcode - 'A');
-		if ((ip->fingerOpcodes[entry].top > 0)
-		    && ip->fingerOpcodes[entry].entries[ip->fingerOpcodes[entry].top - 1]) {
+		fingerprintOpcode func = ip->fingerOpcodes.dispatch[opcode - 'A'];
+		if (func) {
 			// Call the fingerprint.
-			ip->fingerOpcodes[entry].entries[ip->fingerOpcodes[entry].top - 1](ip);
+			func(ip);
 		} else {
 			warn_unknown_instr(opcode, ip);
 			ip_reverse(ip);
@@ -396,6 +407,7 @@ FUNGE_ATTR_FAST CON_RETTYPE execute_instruction(funge_cell opcode, instructionPo
 				break;
 			case 'n':
 				stack_clear(ip->stack);
+				stack_trim(ip->stack);
 				break;
 
 			case ',': {
@@ -407,12 +419,17 @@ FUNGE_ATTR_FAST CON_RETTYPE execute_instruction(funge_cell opcode, instructionPo
 			}
 			case '.':
 				// Reverse on failed output
-				if (FUNGE_UNLIKELY(printf("%" FUNGECELLPRI " ", stack_pop(ip->stack)) < 0))
+				if (FUNGE_UNLIKELY(!output_number(stack_pop(ip->stack))))
 					ip_reverse(ip);
 				break;
 
 			case '~': {
 				funge_cell a;
+#ifdef IO_EVENT_LOOP
+				if (FUNGE_UNLIKELY(setting_io_event_loop) && !input_ready()
+				    && !ioloop_wait_readable(ip, STDIN_FILENO))
+					break;
+#endif
 				if (input_getchar(&a)) {
 					stack_push(ip->stack, a);
 				} else {
@@ -423,8 +440,21 @@ FUNGE_ATTR_FAST CON_RETTYPE execute_instruction(funge_cell opcode, instructionPo
 			case '&': {
 				funge_cell a = 0;
 				ret_getint gotint = rgi_noint;
-				while (gotint == rgi_noint)
+				while (gotint == rgi_noint) {
+#ifdef IO_EVENT_LOOP
+					// Lines without a number are used up, so trying again
+					// later is fine.
+					if (FUNGE_UNLIKELY(setting_io_event_loop) && !input_ready()
+					    && !ioloop_wait_readable(ip, STDIN_FILENO))
+						break;
+#endif
 					gotint = input_getint(&a, 10);
+				}
+#ifdef IO_EVENT_LOOP
+				// Parked.
+				if (gotint == rgi_noint)
+					break;
+#endif
 				if (gotint == rgi_success) {
 					stack_push(ip->stack, a);
 				} else {
@@ -521,7 +551,13 @@ FUNGE_ATTR_FAST CON_RETTYPE execute_instruction(funge_cell opcode, instructionPo
 
 #ifdef CONCURRENT_FUNGE
 			case 't': {
-				ssize_t new_index = iplist_duplicate_ip(&IPList, *threadindex);
+				ssize_t new_index;
+				// The list (and the IPs in it) must not move under a nested run.
+				if (FUNGE_UNLIKELY(nesting != 0)) {
+					ip_reverse(ip);
+					break;
+				}
+				new_index = iplist_duplicate_ip(&IPList, *threadindex);
 				// Handle possible failure.
 				if (new_index != -1) {
 					*threadindex = new_index;
@@ -540,6 +576,9 @@ FUNGE_ATTR_FAST CON_RETTYPE execute_instruction(funge_cell opcode, instructionPo
 				if (IPList->top == 0) {
 					fflush(stdout);
 					exit(0);
+				} else if (FUNGE_UNLIKELY(nesting != 0)) {
+					// Whoever started the nested run still needs the IP.
+					ip_reverse(ip);
 				} else {
 					*threadindex = iplist_terminate_ip(&IPList, *threadindex);
 #  ifdef LARGE_IPLIST
@@ -582,6 +621,33 @@ static inline void thread_forward(instructionPointer * restrict ip)
 	else
 		ip->needMove = true;
 }
+
+/// Get the IP at a given index in the IP list.
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE
+static inline instructionPointer * iplist_get_ip(ssize_t index)
+{
+#  ifdef LARGE_IPLIST
+	return IPList->ips[index];
+#  else
+	return &IPList->ips[index];
+#  endif
+}
+
+#  ifndef DISABLE_TRACE
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void trace_instruction(ssize_t i, const instructionPointer * restrict ip, funge_cell opcode)
+{
+	if (setting_trace_level > 8) {
+		fprintf(stderr, "tix=%zd tid=%" FUNGECELLPRI " x=%" FUNGECELLPRI " y=%" FUNGECELLPRI ": %c (%" FUNGECELLPRI ")\n",
+		        i, ip->ID, ip->position.x, ip->position.y, (char)opcode, opcode);
+		stack_print_top(ip->stack);
+	} else if (setting_trace_level > 3) {
+		fprintf(stderr, "tix=%zd tid=%" FUNGECELLPRI " x=%" FUNGECELLPRI " y=%" FUNGECELLPRI ": %c (%" FUNGECELLPRI ")\n",
+		        i, ip->ID, ip->position.x, ip->position.y, (char)opcode, opcode);
+	} else if (setting_trace_level > 2)
+		fprintf(stderr, "%c", (char)opcode);
+}
+#  endif /* DISABLE_TRACE */
 #endif
 
 
@@ -593,9 +659,53 @@ static inline void interpreter_main_loop(void)
 #endif
 #ifdef CONCURRENT_FUNGE
 	while (true) {
-		ssize_t i = IPList->top;
+		ssize_t i;
 #    ifdef AFL_FUZZ_TESTING
 		long thread_iterations = 1000;
+#    endif
+#    ifdef SPINWAIT_PARKING
+		bool newSlot = true;
+		// Nobody is left that could wake it.
+		if (IPList->top == 0 && FUNGE_UNLIKELY(iplist_get_ip(0)->spinState != NULL))
+			spinwait_release(iplist_get_ip(0));
+#    endif
+#    ifdef IO_EVENT_LOOP
+		if (FUNGE_UNLIKELY(ioloop_waiting != 0))
+			ioloop_run((size_t)IPList->top + 1);
+		// A lone IP just blocks, there is nobody else to run meanwhile.
+		ioloop_alone = true;
+#    endif
+		// As long as there is only a single IP we don't need to walk the list.
+		// We only switch loop between two rounds of the list loop, so this
+		// isn't observable.
+		while (IPList->top == 0) {
+			instructionPointer * ip = iplist_get_ip(0);
+			funge_cell opcode;
+#    ifdef AFL_FUZZ_TESTING
+			if (!iterations--)
+				exit(123);
+#    endif
+			opcode = fungespace_get(&ip->position);
+#    ifndef DISABLE_TRACE
+			if (FUNGE_UNLIKELY(setting_trace_level != 0))
+				trace_instruction(0, ip, opcode);
+#    endif
+			// Nobody can see that a string literal only took one tick.
+			if (FUNGE_UNLIKELY(opcode == '"') && ip->mode == ipmCODE && strcache_run(ip)) {
+				thread_forward(ip);
+				continue;
+			}
+			i = 0;
+			execute_instruction(opcode, ip, &i);
+			// t may have moved the list (and thus the IP) in memory.
+			thread_forward(iplist_get_ip(i));
+		}
+
+#    ifdef IO_EVENT_LOOP
+		ioloop_alone = false;
+#    endif
+		i = IPList->top;
+#    ifdef AFL_FUZZ_TESTING
 		// Give up after too many instructions
 		if (!iterations--)
 			exit(123);
@@ -603,53 +713,55 @@ static inline void interpreter_main_loop(void)
 		while (i >= 0) {
 			bool retval;
 			funge_cell opcode;
+#    ifdef SPINWAIT_PARKING
+			instructionPointer * ip = iplist_get_ip(i);
+			spinwaitAction action = swNone;
+#    endif
 #    ifdef AFL_FUZZ_TESTING
 			if (!thread_iterations--)
 				exit(123);
 #    endif
 
-#    ifdef LARGE_IPLIST
-			opcode = fungespace_get(&IPList->ips[i]->position);
-#    else
-			opcode = fungespace_get(&IPList->ips[i].position);
+#    ifdef IO_EVENT_LOOP
+			if (FUNGE_UNLIKELY(ioloop_is_parked(iplist_get_ip(i)))) {
+				i--;
+				continue;
+			}
 #    endif
-
-#    if !defined(DISABLE_TRACE) && defined(LARGE_IPLIST)
-			if (FUNGE_UNLIKELY(setting_trace_level != 0)) {
-				if (setting_trace_level > 8) {
-					fprintf(stderr, "tix=%zd tid=%" FUNGECELLPRI " x=%" FUNGECELLPRI " y=%" FUNGECELLPRI ": %c (%" FUNGECELLPRI ")\n",
-					        i, IPList->ips[i]->ID, IPList->ips[i]->position.x,
-					        IPList->ips[i]->position.y, (char)opcode, opcode);
-					stack_print_top(IPList->ips[i]->stack);
-				} else if (setting_trace_level > 3) {
-					fprintf(stderr, "tix=%zd tid=%" FUNGECELLPRI " x=%" FUNGECELLPRI " y=%" FUNGECELLPRI ": %c (%" FUNGECELLPRI ")\n",
-					        i, IPList->ips[i]->ID, IPList->ips[i]->position.x,
-					        IPList->ips[i]->position.y, (char)opcode, opcode);
-				} else if (setting_trace_level > 2)
-					fprintf(stderr, "%c", (char)opcode);
+#    ifdef SPINWAIT_PARKING
+			if (FUNGE_UNLIKELY(ip->spinState != NULL) && spinwait_is_parked(ip)) {
+				spinwait_skip(ip);
+				i--;
+				continue;
 			}
-#    elif !defined(DISABLE_TRACE) && !defined(LARGE_IPLIST)
-			if (FUNGE_UNLIKELY(setting_trace_level != 0)) {
-				if (setting_trace_level > 8) {
-					fprintf(stderr, "tix=%zd tid=%" FUNGECELLPRI " x=%" FUNGECELLPRI " y=%" FUNGECELLPRI ": %c (%" FUNGECELLPRI ")\n",
-					        i, IPList->ips[i].ID, IPList->ips[i].position.x,
-					        IPList->ips[i].position.y, (char)opcode, opcode);
-					stack_print_top(IPList->ips[i].stack);
-				} else if (setting_trace_level > 3) {
-					fprintf(stderr, "tix=%zd tid=%" FUNGECELLPRI " x=%" FUNGECELLPRI " y=%" FUNGECELLPRI ": %c (%" FUNGECELLPRI ")\n",
-					        i, IPList->ips[i].ID, IPList->ips[i].position.x,
-					        IPList->ips[i].position.y, (char)opcode, opcode);
-				} else if (setting_trace_level > 2)
-					fprintf(stderr, "%c", (char)opcode);
+#    endif
+
+			opcode = fungespace_get(&iplist_get_ip(i)->position);
+
+#    ifdef SPINWAIT_PARKING
+			if (FUNGE_UNLIKELY(ip->spinState != NULL)) {
+				action = spinwait_before(ip, opcode, newSlot);
+				if (action == swParked) {
+					i--;
+					newSlot = true;
+					continue;
+				}
+			} else if (opcode == 'g' && --ip->spinCountdown == 0) {
+				spinwait_start(ip);
 			}
+#    endif
+
+#    ifndef DISABLE_TRACE
+			if (FUNGE_UNLIKELY(setting_trace_level != 0))
+				trace_instruction(i, iplist_get_ip(i), opcode);
 #    endif /* DISABLE_TRACE */
 
-#    ifdef LARGE_IPLIST
-			retval = execute_instruction(opcode, IPList->ips[i], &i);
-			thread_forward(IPList->ips[i]);
-#    else
-			retval = execute_instruction(opcode, &IPList->ips[i], &i);
-			thread_forward(&IPList->ips[i]);
+			retval = execute_instruction(opcode, iplist_get_ip(i), &i);
+			thread_forward(iplist_get_ip(i));
+#    ifdef SPINWAIT_PARKING
+			if (action == swTrack)
+				spinwait_after(ip);
+			newSlot = !retval;
 #    endif
 			if (!retval)
 				i--;
@@ -678,6 +790,10 @@ static inline void interpreter_main_loop(void)
 		}
 #    endif /* DISABLE_TRACE */
 
+		if (FUNGE_UNLIKELY(opcode == '"') && IP->mode == ipmCODE && strcache_run(IP)) {
+			ip_forward(IP);
+			continue;
+		}
 		execute_instruction(opcode, IP);
 		if (IP->needMove)
 			ip_forward(IP);
@@ -688,6 +804,54 @@ static inline void interpreter_main_loop(void)
 }
 
 
+
+FUNGE_ATTR_FAST void interpreter_run_nested(instructionPointer * restrict ip, const bool * done)
+{
+#ifdef CONCURRENT_FUNGE
+	ssize_t i = IPList->top;
+#  ifdef IO_EVENT_LOOP
+	// Nobody else runs, so waiting for input must block.
+	bool wasAlone = ioloop_alone;
+	ioloop_alone = true;
+#  endif
+	// Only used for tracing, t and @ don't touch it while nested.
+	while (i > 0 && iplist_get_ip(i) != ip)
+		i--;
+#endif
+
+	nesting++;
+	while (!*done) {
+		funge_cell opcode = fungespace_get(&ip->position);
+#ifdef CONCURRENT_FUNGE
+#  ifndef DISABLE_TRACE
+		if (FUNGE_UNLIKELY(setting_trace_level != 0))
+			trace_instruction(i, ip, opcode);
+#  endif
+#endif
+		if (FUNGE_UNLIKELY(opcode == '"') && ip->mode == ipmCODE && strcache_run(ip)) {
+			ip_forward(ip);
+			continue;
+		}
+#ifdef CONCURRENT_FUNGE
+		execute_instruction(opcode, ip, &i);
+#else
+		execute_instruction(opcode, ip);
+#endif
+		// The instruction that set done put the IP back where the run started.
+		if (*done)
+			break;
+		if (ip->needMove)
+			ip_forward(ip);
+		else
+			ip->needMove = true;
+	}
+	ip->needMove = true;
+	nesting--;
+#ifdef IO_EVENT_LOOP
+	ioloop_alone = wasAlone;
+#endif
+}
+
 #ifndef NDEBUG
 // Used with debugging for freeing stuff at end of the program.
 // Not needed, but useful to check that free functions works,
@@ -700,6 +864,8 @@ static void debug_free(void)
 	ip_free(IP);
 # endif
 	sysinfo_cleanup();
+	strcache_free();
+	stackstack_arena_free();
 	fungespace_free();
 }
 #endif
@@ -69,6 +69,17 @@ void execute_instruction(funge_cell opcode,
                          instructionPointer * restrict ip);
 #endif
 
+/**
+ * Run a single IP until *done is set, for fingerprints that run Funge code
+ * from inside a native call. The IP starts at its current position. No other
+ * IP runs meanwhile, and t and @ (unless it is the last IP) reflect.
+ * @param ip The IP to run.
+ * @param done Set by an instruction to end the run. That instruction must
+ *             leave the IP where it should be when the run ends.
+ */
+FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
+void interpreter_run_nested(instructionPointer * restrict ip, const bool * done);
+
 /**
  * Start interpreter on a specific filename.
  * @warning MUST only be called from main.c
@@ -0,0 +1,187 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "global.h"
+#include "ioloop.h"
+
+#ifdef IO_EVENT_LOOP
+
+#include "diagnostic.h"
+#include "settings.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+/// Max number of events to fetch from epoll_wait() at once.
+#define IOLOOP_MAX_EVENTS 32
+
+size_t ioloop_waiting = 0;
+bool   ioloop_alone   = false;
+
+// The epoll instance, created when the first IP is parked.
+static int epoll_fd = -1;
+// Parked IPs, ioloop_waiting of them are used.
+static instructionPointer ** waiters = NULL;
+// Allocated size of waiters.
+static size_t waiters_size = 0;
+// Instructions left until the next check for ready fds.
+static size_t poll_countdown = IOLOOP_POLL_INTERVAL;
+
+/// Can fd be read from without blocking?
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static inline bool fd_readable(int fd)
+{
+	struct pollfd pfd;
+	int retval;
+
+	pfd.fd      = fd;
+	pfd.events  = POLLIN;
+	pfd.revents = 0;
+	do {
+		retval = poll(&pfd, 1, 0);
+	} while (retval == -1 && errno == EINTR);
+	// On errors (and hangups) the instruction will find out itself.
+	return retval != 0;
+}
+
+/// Is some IP waiting for fd?
+FUNGE_ATTR_FAST FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline bool fd_watched(int fd)
+{
+	for (size_t i = 0; i < ioloop_waiting; i++) {
+		if (waiters[i]->ioWaitFd == fd)
+			return true;
+	}
+	return false;
+}
+
+/// Wake all IPs waiting for fd and stop watching it.
+FUNGE_ATTR_FAST
+static void wake_fd(int fd)
+{
+	for (size_t i = 0; i < ioloop_waiting;) {
+		if (waiters[i]->ioWaitFd == fd) {
+			waiters[i]->ioWaitFd = -1;
+			waiters[i] = waiters[--ioloop_waiting];
+		} else {
+			i++;
+		}
+	}
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+FUNGE_ATTR_FAST bool ioloop_wait_readable(instructionPointer * restrict ip, int fd)
+{
+	if (FUNGE_LIKELY(!setting_io_event_loop) || ioloop_alone || fd_readable(fd))
+		return true;
+	// Already parked (on this or another fd), don't count it twice.
+	if (FUNGE_UNLIKELY(ip->ioWaitFd >= 0)) {
+		ip->needMove = false;
+		return false;
+	}
+
+	if (epoll_fd == -1) {
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		// Just block then.
+		if (epoll_fd == -1)
+			return true;
+	}
+	if (!fd_watched(fd)) {
+		struct epoll_event event;
+		event.events  = EPOLLIN;
+		event.data.fd = fd;
+		// Regular files can't be watched, but they never block anyway.
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+			return true;
+	}
+	if (ioloop_waiting == waiters_size) {
+		size_t size = waiters_size ? waiters_size * 2 : 8;
+		instructionPointer ** tmp = (instructionPointer**)realloc(waiters, size * sizeof(instructionPointer*));
+		if (FUNGE_UNLIKELY(!tmp))
+			DIAG_OOM("Could not park IP");
+		waiters = tmp;
+		waiters_size = size;
+	}
+	waiters[ioloop_waiting++] = ip;
+	ip->ioWaitFd = fd;
+	// Run the same instruction again once woken.
+	ip->needMove = false;
+	return false;
+}
+
+FUNGE_ATTR_FAST void ioloop_run(size_t running)
+{
+	struct epoll_event events[IOLOOP_MAX_EVENTS];
+	size_t active = running - ioloop_waiting;
+	int timeout = 0;
+	int count;
+
+	if (active == 0) {
+		// Nothing to do until some input arrives. Show what we have so far.
+		fflush(stdout);
+		timeout = -1;
+	} else if (poll_countdown > active) {
+		poll_countdown -= active;
+		return;
+	}
+	poll_countdown = IOLOOP_POLL_INTERVAL;
+
+	do {
+		count = epoll_wait(epoll_fd, events, IOLOOP_MAX_EVENTS, timeout);
+	} while (count == -1 && errno == EINTR);
+	if (FUNGE_UNLIKELY(count == -1)) {
+		// Can't wait here: wake everyone, they will block in the instruction.
+		while (ioloop_waiting != 0)
+			wake_fd(waiters[0]->ioWaitFd);
+		return;
+	}
+	for (int i = 0; i < count; i++)
+		wake_fd(events[i].data.fd);
+}
+
+FUNGE_ATTR_FAST void ioloop_fd_closing(int fd)
+{
+	if (ioloop_waiting != 0 && fd_watched(fd))
+		wake_fd(fd);
+}
+
+FUNGE_ATTR_FAST void ioloop_forget(instructionPointer * restrict ip)
+{
+	int fd = ip->ioWaitFd;
+
+	if (fd < 0)
+		return;
+	for (size_t i = 0; i < ioloop_waiting; i++) {
+		if (waiters[i] == ip) {
+			waiters[i] = waiters[--ioloop_waiting];
+			break;
+		}
+	}
+	ip->ioWaitFd = -1;
+	if (!fd_watched(fd))
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+#endif /* IO_EVENT_LOOP */
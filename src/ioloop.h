@@ -0,0 +1,122 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ * Event loop that lets a concurrent IP wait for input without stopping the
+ * others.
+ *
+ * With the -N option, instructions that would block reading from a file
+ * descriptor (~, &, SOCK A and R, FILE G and R) call ioloop_wait_readable()
+ * first. If nothing can be read yet the IP is parked: it stays on the
+ * instruction and the main loop skips it, while the fd is watched with
+ * epoll. Once the fd becomes readable the IP runs the instruction again.
+ * When every IP is parked the main loop sleeps in epoll_wait() instead.
+ *
+ * A lone IP is never parked, it just blocks in the instruction as usual.
+ *
+ * Only available with IO_EVENT_LOOP, which requires CONCURRENT_FUNGE and
+ * LARGE_IPLIST (IPs must not move in memory while parked).
+ */
+
+#ifndef FUNGE_HAD_SRC_IOLOOP_H
+#define FUNGE_HAD_SRC_IOLOOP_H
+
+#include "global.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ip.h"
+
+#ifdef IO_EVENT_LOOP
+
+/// Number of instructions to run between checks for ready fds while some
+/// IPs are parked and others are running.
+#define IOLOOP_POLL_INTERVAL 4096
+
+/// Number of parked IPs. Only read this, don't change it.
+extern size_t ioloop_waiting;
+
+/// Set while IPs must block instead of being parked: by the main loop while
+/// only one IP is alive, and while running an instruction under k.
+extern bool ioloop_alone;
+
+/**
+ * Check if fd can be read from (or accepted on) without blocking, and if not
+ * park the IP until it can. The instruction must not have changed anything
+ * (such as popping the stack) before calling this.
+ * @param ip IP executing the instruction.
+ * @param fd File descriptor the instruction is about to read from.
+ * @return True if the instruction should go ahead. False if the IP was
+ *         parked: the instruction should just return, it will be executed
+ *         again when the fd is ready.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool ioloop_wait_readable(instructionPointer * restrict ip, int fd);
+
+/// Check if an IP is parked.
+#define ioloop_is_parked(m_ip) ((m_ip)->ioWaitFd >= 0)
+
+/**
+ * Wake parked IPs whose fds are ready. Called from the main loop between
+ * rounds while ioloop_waiting is non-zero.
+ * @param running Number of IPs alive, parked or not.
+ */
+FUNGE_ATTR_FAST
+void ioloop_run(size_t running);
+
+/**
+ * Wake the IPs waiting for fd. Call before closing a fd, so nobody is left
+ * waiting for it forever.
+ * @param fd File descriptor about to be closed.
+ */
+FUNGE_ATTR_FAST
+void ioloop_fd_closing(int fd);
+
+/**
+ * Stop waiting for an IP without waking it. Used when freeing the IP.
+ * @param ip IP to operate on.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void ioloop_forget(instructionPointer * restrict ip);
+
+#else
+
+// Without the event loop everything just blocks.
+FUNGE_ATTR_FAST
+static inline bool ioloop_wait_readable(instructionPointer * restrict ip, int fd)
+{
+	(void)ip;
+	(void)fd;
+	return true;
+}
+
+FUNGE_ATTR_FAST
+static inline void ioloop_fd_closing(int fd)
+{
+	(void)fd;
+}
+
+#endif /* IO_EVENT_LOOP */
+
+#endif
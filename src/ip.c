@@ -35,8 +35,16 @@
 #include "vector.h"
 
 #include "fingerprints/manager.h"
+#include "fingerprints/CFFI/CFFI.h"
 #include "funge-space/funge-space.h"
 
+#ifdef SPINWAIT_PARKING
+#  include "spinwait.h"
+#endif
+#ifdef IO_EVENT_LOOP
+#  include "ioloop.h"
+#endif
+
 #include <assert.h>
 #include <string.h> /* memcpy */
 
@@ -68,9 +76,18 @@ static inline bool ip_create_in_place(instructionPointer *me)
 	me->ID                   = 0;
 	// Zero the opcode stacks if needed.
 	if (FUNGE_LIKELY(!setting_disable_fingerprints)) {
-		memset(me->fingerOpcodes, 0, sizeof(fungeOpcodeStack) * FINGEROPCODECOUNT);
+		memset(&me->fingerOpcodes, 0, sizeof(fungeOpcodeOverlay));
 	}
 	me->fingerHRTItimestamp  = NULL;
+	me->fingerCFFIstate      = NULL;
+#ifdef SPINWAIT_PARKING
+	me->spinState            = NULL;
+	me->spinCountdown        = SPINWAIT_INITIAL_COUNTDOWN;
+	me->spinFailures         = 0;
+#endif
+#ifdef IO_EVENT_LOOP
+	me->ioWaitFd             = -1;
+#endif
 	return true;
 }
 
@@ -108,6 +125,19 @@ static inline bool ip_duplicate_in_place(const instructionPointer * restrict old
 		manager_duplicate(old, new);
 	}
 	new->fingerHRTItimestamp  = NULL;
+	if (FUNGE_UNLIKELY(!finger_CFFI_duplicate_ip(old, new))) {
+		stackstack_free(new->stackstack);
+		if (FUNGE_LIKELY(!setting_disable_fingerprints))
+			manager_free(new);
+		memset(new, 0, sizeof(instructionPointer));
+		return false;
+	}
+#ifdef SPINWAIT_PARKING
+	new->spinState            = NULL;
+#endif
+#ifdef IO_EVENT_LOOP
+	new->ioWaitFd             = -1;
+#endif
 	return true;
 }
 #endif
@@ -129,6 +159,13 @@ FUNGE_ATTR_FAST static inline void ip_free_resources(instructionPointer * ip)
 		free(ip->fingerHRTItimestamp);
 		ip->fingerHRTItimestamp = NULL;
 	}
+	finger_CFFI_free_ip(ip);
+#  ifdef SPINWAIT_PARKING
+	spinwait_forget(ip);
+#  endif
+#  ifdef IO_EVENT_LOOP
+	ioloop_forget(ip);
+#  endif
 #  ifdef LARGE_IPLIST
 	cf_mempool_ip_free(ip);
 #  endif
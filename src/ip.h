@@ -45,8 +45,10 @@
 /// Type of the ipMode entry.
 typedef uint_fast8_t ipMode;
 
-/// This is for size of opcode array.
-#define FINGEROPCODECOUNT 26
+#ifdef SPINWAIT_PARKING
+struct s_spinState;
+#endif
+struct s_cffiState;
 
 /// Instruction pointer.
 /// @note
@@ -66,9 +68,18 @@ typedef struct s_instructionPointer {
 	bool               fingerSUBRisRelative; ///< Data for fingerprint SUBR.
 	funge_cell         ID;                   ///< The ID of this IP.
 	funge_stackstack * stackstack;           ///< The stack stack.
-	fungeOpcodeStack   fingerOpcodes[FINGEROPCODECOUNT]; ///< Array of fingerprint opcodes.
+	fungeOpcodeOverlay fingerOpcodes;        ///< Loaded fingerprint opcodes.
 	void             * fingerHRTItimestamp;  ///< Data for fingerprint HRTI.
 	                                         ///  We don't know what type here.
+	struct s_cffiState * fingerCFFIstate;    ///< Pointer stack of fingerprint CFFI.
+#ifdef SPINWAIT_PARKING
+	struct s_spinState * spinState;          ///< Spin-wait detection state, see spinwait.h.
+	uint_fast16_t      spinCountdown;        ///< Number of g left until next detection attempt.
+	uint_fast8_t       spinFailures;         ///< Number of failed detection attempts in a row.
+#endif
+#ifdef IO_EVENT_LOOP
+	int                ioWaitFd;             ///< File descriptor the IP is parked on, or -1. See ioloop.h.
+#endif
 } instructionPointer;
 #define CF_INSTRUCTIONPOINTER_DEFINED
 
@@ -39,16 +39,16 @@
 
 #include "diagnostic.h"
 #include "interpreter.h"
+#include "output.h"
 #include "settings.h"
 #include "fingerprints/manager.h"
+#include "fingerprints/CFFI/CFFI.h"
 
 const char *const *fungeargv = NULL;
 int fungeargc = 0;
 
 // Exclude some code if we are building in IFFI.
 #ifndef CFUN_IS_IFFI
-// Use a larger buffer for stdout in fully buffered mode.
-static char cfun_iobuf[BUFSIZ * 4];
 
 // These are NOT worth inlineing, even though only called once.
 FUNGE_ATTR_NOINLINE FUNGE_ATTR_COLD FUNGE_ATTR_NORET
@@ -67,6 +67,18 @@ static void print_features(void)
 	     " - Tracing using -t <level> option is disabled.\n"
 #endif
 
+#ifdef IO_EVENT_LOOP
+	     " + Letting IPs wait for input without blocking others using -N option is enabled.\n"
+#else
+	     " - Letting IPs wait for input without blocking others using -N option is disabled.\n"
+#endif
+
+#ifdef OUTPUT_THREAD
+	     " + Writing output from a separate thread using -O option is enabled.\n"
+#else
+	     " - Writing output from a separate thread using -O option is disabled.\n"
+#endif
+
 #ifdef CFUN_EXACT_BOUNDS
 	     " + This binary uses exact bounds in y.\n"
 #else
@@ -115,11 +127,19 @@ static void print_help(void)
 {
 	puts("Usage: cfunge [OPTIONS] [FILE] [PROGRAM OPTIONS]\n"
 	     "A fast Befunge interpreter in C\n\n"
-	     " -b           Use fully buffered output (default is system default for stdout).\n"
+	     " -b           Use fully buffered output even if stdout is a terminal.\n"
+	     " -B size      Use fully buffered output with a buffer of size bytes.\n"
 	     " -E           Show non-fatal error messages, fatal ones are always shown.\n"
 	     " -F           Disable all fingerprints.\n"
 	     " -f           Show list of features and fingerprints supported in this binary.\n"
 	     " -h           Show this help and exit.\n"
+	     " -L lib:sym   Load library lib and look up symbol sym at startup, for use with\n"
+	     "              CFFX G. An empty lib means the program itself. May be repeated,\n"
+	     "              the first symbol is number 0.\n"
+	     " -N           Let an IP waiting for input (~, &, SOCK and FILE reads) wait\n"
+	     "              alone while the other IPs keep running.\n"
+	     " -O           Write output from a separate thread, so that a slow reader\n"
+	     "              doesn't stall the program.\n"
 	     " -S           Enable sandbox mode (see README for details).\n"
 	     " -s standard  Use the given standard (one of 93, 98 [default] and 109).\n"
 	     " -t level     Use given trace level. Default 0.\n"
@@ -221,6 +241,9 @@ static void print_version(void)
 int main(int argc, char *argv[])
 {
 	int opt;
+	bool fullyBuffered = false;
+	bool outputThread = false;
+	size_t bufferSize = 0;
 
 #ifdef FUZZ_TESTING
 	struct rlimit limit;
@@ -233,11 +256,20 @@ int main(int argc, char *argv[])
 	// We detect socket issues in other ways.
 	signal(SIGPIPE, SIG_IGN);
 
-	while ((opt = getopt(argc, argv, "+bEFfhSs:t:VvW")) != -1) {
+	while ((opt = getopt(argc, argv, "+bB:EFfhL:NOSs:t:VvW")) != -1) {
 		switch (opt) {
 			case 'b':
-				setvbuf(stdout, cfun_iobuf, _IOFBF, sizeof(cfun_iobuf));
+				fullyBuffered = true;
 				break;
+			case 'B': {
+				char * end;
+				unsigned long size = strtoul(optarg, &end, 10);
+				if (*end != '\0' || size == 0)
+					diag_fatal_format("%s is not valid for -B.\n", optarg);
+				fullyBuffered = true;
+				bufferSize = (size_t)size;
+				break;
+			}
 			case 'E':
 				setting_enable_errors = true;
 				break;
@@ -250,6 +282,20 @@ int main(int argc, char *argv[])
 			case 'h':
 				print_help();
 				break;
+			case 'L':
+				if (!finger_CFFI_preload(optarg))
+					diag_fatal_format("Could not load %s for -L.\n", optarg);
+				break;
+			case 'N':
+#ifdef IO_EVENT_LOOP
+				setting_io_event_loop = true;
+#else
+				diag_fatal("This binary doesn't support -N.");
+#endif
+				break;
+			case 'O':
+				outputThread = true;
+				break;
 			case 'S':
 				setting_enable_sandbox = true;
 				break;
@@ -288,6 +334,8 @@ int main(int argc, char *argv[])
 		// by the y instruction.
 		fungeargc = argc - optind;
 		fungeargv = (const char * const *)&argv[optind];
+		if (!output_setup(fullyBuffered, bufferSize, outputThread))
+			diag_fatal("Could not start the output thread (or this binary doesn't support it).");
 		// Run the actual interpreter (never returns).
 		interpreter_run(argv[optind]);
 	}
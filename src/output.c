@@ -0,0 +1,251 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "output.h"
+
+#include "diagnostic.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h> /* isatty, fstat */
+
+#ifdef OUTPUT_THREAD
+#  include <errno.h>
+#  include <pthread.h>
+#endif
+
+/// Should output_flush_for_input() flush? Only changed by output_setup(),
+/// so IFFI (which doesn't call it) keeps the old behaviour.
+static bool flush_for_input = true;
+
+FUNGE_ATTR_FAST bool output_number(funge_cell value)
+{
+	// Digits of the largest cell, sign and the trailing space.
+	char buf[sizeof(funge_cell) * 3 + 2];
+	char * p = buf + sizeof(buf);
+	funge_unsigned_cell magnitude;
+	size_t length;
+
+	// Negate as unsigned so FUNGECELL_MIN works.
+	if (value < 0)
+		magnitude = (funge_unsigned_cell)0 - (funge_unsigned_cell)value;
+	else
+		magnitude = (funge_unsigned_cell)value;
+
+	*--p = ' ';
+	do {
+		*--p = (char)('0' + (magnitude % 10));
+		magnitude /= 10;
+	} while (magnitude != 0);
+	if (value < 0)
+		*--p = '-';
+
+	length = (size_t)(buf + sizeof(buf) - p);
+	return fwrite(p, 1, length, stdout) == length;
+}
+
+FUNGE_ATTR_FAST void output_flush_for_input(void)
+{
+	if (flush_for_input)
+		fflush(stdout);
+}
+
+#ifdef OUTPUT_THREAD
+/*
+ * The writer thread: stdout (fd 1) is replaced with a pipe. One thread reads
+ * the pipe into a queue of chunks, another writes the chunks to the real
+ * stdout. The queue is unbounded, so the program only waits for the reader
+ * thread, never for whoever reads our output.
+ */
+
+/// Size of the chunks in the queue.
+#define OUTPUT_CHUNK_SIZE (64 * 1024)
+
+typedef struct s_outputChunk {
+	struct s_outputChunk * next;
+	size_t                 length;
+	char                   data[OUTPUT_CHUNK_SIZE];
+} outputChunk;
+
+static int              real_fd   = -1;
+static int              pipe_read = -1;
+static pid_t            owner_pid;
+static pthread_t        reader_thread;
+static pthread_t        writer_thread;
+static pthread_mutex_t  queue_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   queue_ready = PTHREAD_COND_INITIALIZER;
+static outputChunk    * queue_head  = NULL;
+static outputChunk    * queue_tail  = NULL;
+static bool             queue_done  = false;
+
+static void * output_reader(void * arg)
+{
+	(void)arg;
+	for (;;) {
+		ssize_t n;
+		outputChunk * chunk = (outputChunk*)malloc(sizeof(outputChunk));
+		if (FUNGE_UNLIKELY(!chunk))
+			DIAG_OOM("Could not allocate output buffer");
+		do {
+			n = read(pipe_read, chunk->data, OUTPUT_CHUNK_SIZE);
+		} while (n == -1 && errno == EINTR);
+		if (n <= 0) {
+			free(chunk);
+			break;
+		}
+		chunk->length = (size_t)n;
+		chunk->next = NULL;
+		pthread_mutex_lock(&queue_lock);
+		if (queue_tail)
+			queue_tail->next = chunk;
+		else
+			queue_head = chunk;
+		queue_tail = chunk;
+		pthread_cond_signal(&queue_ready);
+		pthread_mutex_unlock(&queue_lock);
+	}
+	pthread_mutex_lock(&queue_lock);
+	queue_done = true;
+	pthread_cond_signal(&queue_ready);
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+static void * output_writer(void * arg)
+{
+	// After a write error the rest is discarded, like a closed pipe would.
+	bool failed = false;
+
+	(void)arg;
+	for (;;) {
+		outputChunk * chunk;
+		pthread_mutex_lock(&queue_lock);
+		while (!queue_head && !queue_done)
+			pthread_cond_wait(&queue_ready, &queue_lock);
+		chunk = queue_head;
+		if (chunk) {
+			queue_head = chunk->next;
+			if (!queue_head)
+				queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&queue_lock);
+		if (!chunk)
+			break;
+		for (size_t done = 0; !failed && done < chunk->length;) {
+			ssize_t n = write(real_fd, chunk->data + done, chunk->length - done);
+			if (n >= 0)
+				done += (size_t)n;
+			else if (errno != EINTR)
+				failed = true;
+		}
+		free(chunk);
+	}
+	return NULL;
+}
+
+/// atexit() handler: write what is left and restore stdout.
+static void output_thread_stop(void)
+{
+	// Forked children must not touch the threads of the parent.
+	if (getpid() != owner_pid)
+		return;
+	fflush(stdout);
+	// This closes the write end of the pipe, so the reader gets EOF.
+	dup2(real_fd, STDOUT_FILENO);
+	pthread_join(reader_thread, NULL);
+	pthread_join(writer_thread, NULL);
+}
+
+FUNGE_ATTR_WARN_UNUSED
+static bool output_thread_start(void)
+{
+	int fds[2];
+	bool readerStarted = false;
+
+	real_fd = dup(STDOUT_FILENO);
+	if (real_fd == -1)
+		return false;
+	if (pipe(fds) == -1) {
+		close(real_fd);
+		return false;
+	}
+	pipe_read = fds[0];
+	if (dup2(fds[1], STDOUT_FILENO) == -1)
+		goto error;
+	close(fds[1]);
+	fds[1] = -1;
+	if (pthread_create(&reader_thread, NULL, &output_reader, NULL) != 0)
+		goto error;
+	// From now on the read end belongs to the reader thread.
+	readerStarted = true;
+	// If this fails the reader thread gets EOF and exits once stdout is
+	// restored below.
+	if (pthread_create(&writer_thread, NULL, &output_writer, NULL) != 0)
+		goto error;
+	owner_pid = getpid();
+	atexit(&output_thread_stop);
+	return true;
+error:
+	dup2(real_fd, STDOUT_FILENO);
+	close(real_fd);
+	if (fds[1] != -1)
+		close(fds[1]);
+	if (!readerStarted) {
+		close(pipe_read);
+		pipe_read = -1;
+	}
+	return false;
+}
+#endif /* OUTPUT_THREAD */
+
+bool output_setup(bool fullyBuffered, size_t size, bool thread)
+{
+	struct stat st;
+	bool tty = isatty(STDOUT_FILENO);
+
+	if (thread) {
+#ifdef OUTPUT_THREAD
+		if (!output_thread_start())
+			return false;
+#else
+		return false;
+#endif
+	}
+
+	if (fullyBuffered || !tty) {
+		char * buffer;
+		if (size == 0)
+			size = OUTPUT_DEFAULT_BUFFER_SIZE;
+		// Never freed: stdio may use it until the very end.
+		buffer = (char*)malloc(size);
+		setvbuf(stdout, buffer, _IOFBF, buffer ? size : BUFSIZ);
+	} else if (thread) {
+		// stdout is a pipe now, but the user is still looking at a terminal.
+		setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+	}
+
+	// If input comes from a file it can't be waiting for our output.
+	if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+		flush_for_input = false;
+	return true;
+}
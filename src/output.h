@@ -0,0 +1,70 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Output to STDOUT: buffering setup, fast number output and the optional
+ * writer thread.
+ *
+ * All output still goes through stdio, so fingerprints (and child processes,
+ * after an fflush()) can keep writing to stdout directly.
+ */
+
+#ifndef FUNGE_HAD_SRC_OUTPUT_H
+#define FUNGE_HAD_SRC_OUTPUT_H
+
+#include "global.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Buffer size used for fully buffered output if none is given.
+#define OUTPUT_DEFAULT_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Set up buffering of stdout. Call once, before any output.
+ * stdout is fully buffered if it isn't a terminal or if fullyBuffered is set,
+ * otherwise the system default (line buffered) is kept.
+ * @param fullyBuffered Use full buffering even for terminals.
+ * @param size Size of buffer in bytes, 0 for OUTPUT_DEFAULT_BUFFER_SIZE.
+ * @param thread Write the output from a separate thread, so a slow reader
+ *               doesn't stall the program. Returns false if not supported.
+ * @return False if the writer thread could not be started.
+ */
+FUNGE_ATTR_WARN_UNUSED
+bool output_setup(bool fullyBuffered, size_t size, bool thread);
+
+/**
+ * Write a number followed by a space, like the . instruction.
+ * @param value Number to write.
+ * @return False on error.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+bool output_number(funge_cell value);
+
+/**
+ * Flush stdout before waiting for input, unless the input can't possibly
+ * depend on the output (stdin is a regular file).
+ */
+FUNGE_ATTR_FAST
+void output_flush_for_input(void);
+
+#endif
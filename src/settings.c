@@ -32,3 +32,4 @@ bool setting_enable_warnings = false;
 bool setting_enable_errors = false;
 bool setting_disable_fingerprints = false;
 bool setting_enable_sandbox = false;
+bool setting_io_event_loop = false;
@@ -67,4 +67,8 @@ extern bool setting_disable_fingerprints;
 /// - In fingerprints: Non-safe fingerprints are not loaded.
 extern bool setting_enable_sandbox;
 
+/// Let concurrent IPs wait for input without stopping the others, see
+/// ioloop.h. Only has an effect with IO_EVENT_LOOP.
+extern bool setting_io_event_loop;
+
 #endif
@@ -0,0 +1,373 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "global.h"
+#include "spinwait.h"
+
+#ifdef SPINWAIT_PARKING
+
+#include "interpreter.h"
+#include "settings.h"
+#include "stack.h"
+#include "funge-space/funge-space.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h> /* memcpy, memcmp */
+
+/// Number of hash buckets for watches, must be a power of two.
+#define SPINWAIT_BUCKETS 256
+/// Max value of ip->spinFailures, limits how long we back off.
+#define SPINWAIT_MAX_FAILURES 12
+
+size_t spinwait_watcher_count = 0;
+
+/// Watches, hashed on cell.
+static spinWatch *watchBuckets[SPINWAIT_BUCKETS];
+
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline size_t watch_hash(const funge_vector * restrict cell)
+{
+	return ((funge_unsigned_cell)cell->x * 31 + (funge_unsigned_cell)cell->y) & (SPINWAIT_BUCKETS - 1);
+}
+
+/**
+ * Can this instruction be part of a spin-wait? It must not have any side
+ * effects outside the IP and may only read Funge-Space in ways we can track.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_CONST FUNGE_ATTR_WARN_UNUSED
+static inline bool is_pure_instruction(funge_cell opcode)
+{
+	switch (opcode) {
+		case ' ': case ';': case 'z':
+		case '^': case '>': case 'v': case '<':
+		case '#': case 'j': case 'r': case '[': case ']': case 'x':
+		case '_': case '|': case 'w':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+		case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+		case '+': case '-': case '*': case '/': case '%': case '!': case '`':
+		case ':': case '$': case '\\': case 'n':
+		case 'g': case '\'':
+			return true;
+		default:
+			return false;
+	}
+}
+
+/// Remove all watches of an IP.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void unwatch(spinState * restrict state)
+{
+	if (state->cellCount == 0)
+		return;
+	for (size_t i = 0; i < state->cellCount; i++) {
+		spinWatch * watch = &state->watches[i];
+		*watch->prevNext = watch->next;
+		if (watch->next)
+			watch->next->prevNext = watch->prevNext;
+	}
+	state->cellCount = 0;
+	spinwait_watcher_count--;
+}
+
+/// Drop the spin state of an IP.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void drop_state(instructionPointer * restrict ip)
+{
+	unwatch(ip->spinState);
+	free(ip->spinState);
+	ip->spinState = NULL;
+}
+
+/// Give up on the current detection attempt and back off before the next.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void spin_fail(instructionPointer * restrict ip)
+{
+	drop_state(ip);
+	if (ip->spinFailures < SPINWAIT_MAX_FAILURES)
+		ip->spinFailures++;
+	ip->spinCountdown = (uint_fast16_t)(SPINWAIT_INITIAL_COUNTDOWN << ip->spinFailures);
+}
+
+/// Start watching a cell read during the cycle.
+/// @return False if there were too many cells.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool add_cell(instructionPointer * restrict ip, const funge_vector * restrict cell)
+{
+	spinState * state = ip->spinState;
+	spinWatch * watch;
+	spinWatch ** bucket;
+
+	// Native memory (CFFI) can change without a write we would notice.
+	if (FUNGE_UNLIKELY(fungespace_is_native(cell)))
+		return false;
+	for (size_t i = 0; i < state->cellCount; i++) {
+		if (state->watches[i].cell.x == cell->x && state->watches[i].cell.y == cell->y)
+			return true;
+	}
+	if (state->cellCount == SPINWAIT_MAX_CELLS)
+		return false;
+	if (state->cellCount == 0)
+		spinwait_watcher_count++;
+	watch = &state->watches[state->cellCount++];
+	bucket = &watchBuckets[watch_hash(cell)];
+	watch->cell = *cell;
+	watch->ip = ip;
+	watch->next = *bucket;
+	watch->prevNext = bucket;
+	if (*bucket)
+		(*bucket)->prevNext = &watch->next;
+	*bucket = watch;
+	return true;
+}
+
+/// Is the IP back in exactly the state it was at the start of the cycle?
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool cycle_complete(const instructionPointer * restrict ip,
+                           const spinState * restrict state)
+{
+	const funge_stack * stack = ip->stack;
+	if (ip->position.x != state->startPosition.x
+	    || ip->position.y != state->startPosition.y
+	    || ip->delta.x != state->startDelta.x
+	    || ip->delta.y != state->startDelta.y
+	    || stack->top != state->startTop)
+		return false;
+	// Nothing below lowWater was touched, the rest must match the snapshot.
+	return memcmp(&stack->entries[state->lowWater],
+	              &state->snapshot[state->lowWater - state->snapshotBase],
+	              (state->startTop - state->lowWater) * sizeof(funge_cell)) == 0;
+}
+
+/// Wake a parked IP and replay the ticks it missed.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void wake(instructionPointer * restrict ip)
+{
+	spinState * state = ip->spinState;
+	// The IP would have gone round the cycle a number of times, only the
+	// remainder matters.
+	size_t replay = state->skipped % state->slots;
+
+	assert(state->parked);
+	drop_state(ip);
+	ip->spinFailures = 0;
+	ip->spinCountdown = SPINWAIT_INITIAL_COUNTDOWN;
+
+	// Same as one round of the main loop for this IP. Only pure instructions
+	// are in the cycle so they will not touch the IP list or Funge-Space.
+	while (replay--) {
+		bool retval;
+		do {
+			ssize_t index = 0;
+			funge_cell opcode = fungespace_get(&ip->position);
+			retval = execute_instruction(opcode, ip, &index);
+			if (ip->needMove)
+				ip_forward(ip);
+			else
+				ip->needMove = true;
+		} while (retval);
+	}
+}
+
+FUNGE_ATTR_FAST void spinwait_start(instructionPointer * restrict ip)
+{
+	// Tracing would show the replayed instructions at the wrong point in time.
+	if (setting_trace_level != 0) {
+		ip->spinFailures = SPINWAIT_MAX_FAILURES;
+		ip->spinCountdown = (uint_fast16_t)(SPINWAIT_INITIAL_COUNTDOWN << SPINWAIT_MAX_FAILURES);
+		return;
+	}
+	ip->spinState = calloc(1, sizeof(spinState));
+	if (FUNGE_UNLIKELY(!ip->spinState))
+		ip->spinCountdown = SPINWAIT_INITIAL_COUNTDOWN;
+}
+
+FUNGE_ATTR_FAST spinwaitAction spinwait_before(instructionPointer * restrict ip,
+                                               funge_cell opcode, bool newSlot)
+{
+	spinState * state = ip->spinState;
+	const funge_stack * stack = ip->stack;
+
+	if (!state->recording) {
+		// Cycles start and end at the start of a tick.
+		if (!newSlot)
+			return swNone;
+		state->recording = true;
+		state->startPosition = ip->position;
+		state->startDelta = ip->delta;
+		state->startTop = stack->top;
+		state->snapshotBase = (stack->top > SPINWAIT_MAX_STACK) ? stack->top - SPINWAIT_MAX_STACK : 0;
+		state->lowWater = stack->top;
+		memcpy(state->snapshot, &stack->entries[state->snapshotBase],
+		       (stack->top - state->snapshotBase) * sizeof(funge_cell));
+	} else if (newSlot) {
+		state->slots++;
+		if (cycle_complete(ip, state)) {
+			state->parked = true;
+			// We skip the tick we parked in.
+			state->skipped = 1;
+			return swParked;
+		}
+		if (state->slots >= SPINWAIT_MAX_SLOTS) {
+			spin_fail(ip);
+			return swNone;
+		}
+	}
+
+	if (ip->mode != ipmCODE || !is_pure_instruction(opcode)) {
+		spin_fail(ip);
+		return swNone;
+	}
+
+	// Track what cells the instruction reads.
+	if (!add_cell(ip, &ip->position)) {
+		spin_fail(ip);
+		return swNone;
+	}
+	if (opcode == 'g') {
+		funge_vector cell;
+		cell.y = (stack->top > 0) ? stack->entries[stack->top - 1] : 0;
+		cell.x = (stack->top > 1) ? stack->entries[stack->top - 2] : 0;
+		cell.x += ip->storageOffset.x;
+		cell.y += ip->storageOffset.y;
+		if (!add_cell(ip, &cell)) {
+			spin_fail(ip);
+			return swNone;
+		}
+	} else if (opcode == '\'') {
+		funge_vector cell;
+		cell.x = ip->position.x + ip->delta.x;
+		cell.y = ip->position.y + ip->delta.y;
+		fungespace_wrap(&cell, &ip->delta);
+		if (!add_cell(ip, &cell)) {
+			spin_fail(ip);
+			return swNone;
+		}
+	}
+
+	// And what part of the stack it may change. No pure instruction pops
+	// more than two cells, except n.
+	if (opcode == 'n') {
+		state->lowWater = 0;
+	} else if (stack->top < state->lowWater + 2) {
+		state->lowWater = (stack->top > 2) ? stack->top - 2 : 0;
+	}
+	if (state->lowWater < state->snapshotBase) {
+		spin_fail(ip);
+		return swNone;
+	}
+
+	state->wrapCount = fungespace_get_wrap_count();
+	state->lastOpcode = opcode;
+	state->lastPosition = ip->position;
+	return swTrack;
+}
+
+FUNGE_ATTR_FAST void spinwait_after(instructionPointer * restrict ip)
+{
+	spinState * state = ip->spinState;
+
+	// A cycle that wraps depends on the bounds, we don't track that. One
+	// that doesn't wrap only moves between the non-space cells it reads, so
+	// the bounds can't shrink past it as long as those cells don't change.
+	if (fungespace_get_wrap_count() != state->wrapCount) {
+		spin_fail(ip);
+		return;
+	}
+	// Space and ; read every cell up to where the IP ended up.
+	if (state->lastOpcode == ' ' || state->lastOpcode == ';') {
+		funge_vector cell = state->lastPosition;
+		for (size_t n = 0; ; n++) {
+			cell.x += ip->delta.x;
+			cell.y += ip->delta.y;
+			if (cell.x == ip->position.x && cell.y == ip->position.y)
+				break;
+			if (n == SPINWAIT_MAX_CELLS || !add_cell(ip, &cell)) {
+				spin_fail(ip);
+				return;
+			}
+		}
+	}
+}
+
+FUNGE_ATTR_FAST void spinwait_release(instructionPointer * restrict ip)
+{
+	if (!ip->spinState)
+		return;
+	if (ip->spinState->parked) {
+		wake(ip);
+	} else {
+		drop_state(ip);
+		ip->spinCountdown = SPINWAIT_INITIAL_COUNTDOWN;
+	}
+}
+
+FUNGE_ATTR_FAST void spinwait_forget(instructionPointer * restrict ip)
+{
+	if (ip->spinState)
+		drop_state(ip);
+}
+
+/// Wake the IP if parked, otherwise restart detection.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void cell_changed(instructionPointer * restrict ip)
+{
+	if (ip->spinState->parked)
+		wake(ip);
+	else
+		spin_fail(ip);
+}
+
+FUNGE_ATTR_FAST void spinwait_notify_write(const funge_vector * restrict position)
+{
+	spinWatch ** bucket = &watchBuckets[watch_hash(position)];
+	spinWatch * watch = *bucket;
+	while (watch) {
+		if (watch->cell.x == position->x && watch->cell.y == position->y) {
+			// This removes watches from the bucket, start over.
+			cell_changed(watch->ip);
+			watch = *bucket;
+		} else {
+			watch = watch->next;
+		}
+	}
+}
+
+FUNGE_ATTR_FAST void spinwait_notify_area(const funge_vector * restrict min,
+                                          const funge_vector * restrict max)
+{
+	for (size_t i = 0; i < SPINWAIT_BUCKETS; i++) {
+		spinWatch * watch = watchBuckets[i];
+		while (watch) {
+			if (watch->cell.x >= min->x && watch->cell.x <= max->x
+			    && watch->cell.y >= min->y && watch->cell.y <= max->y) {
+				// This removes watches from the bucket, start over.
+				cell_changed(watch->ip);
+				watch = watchBuckets[i];
+			} else {
+				watch = watch->next;
+			}
+		}
+	}
+}
+
+#endif /* SPINWAIT_PARKING */
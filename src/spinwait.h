@@ -0,0 +1,171 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Detection and parking of IPs that busy wait on Funge-Space cells.
+ *
+ * An IP that executes g is watched for a while. If it comes back to exactly
+ * the same state (position, delta and stack) after a short cycle of side
+ * effect free instructions, during which none of the cells it read changed,
+ * it will keep doing that until one of those cells changes. Such an IP is
+ * parked: the main loop skips it and just counts the ticks it missed. When a
+ * watched cell is about to be written the IP is woken up and the missed
+ * ticks (modulo the cycle length) are replayed, so the result is the same as
+ * if it had been running all the time.
+ *
+ * Only available with SPINWAIT_PARKING, which requires CONCURRENT_FUNGE and
+ * LARGE_IPLIST (IPs must not move in memory while parked).
+ */
+
+#ifndef FUNGE_HAD_SRC_SPINWAIT_H
+#define FUNGE_HAD_SRC_SPINWAIT_H
+
+#include "global.h"
+
+#ifdef SPINWAIT_PARKING
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ip.h"
+#include "vector.h"
+
+/// Number of g to execute before (re)trying to detect a spin-wait.
+#define SPINWAIT_INITIAL_COUNTDOWN 4
+/// Max number of ticks in a cycle.
+#define SPINWAIT_MAX_SLOTS 64
+/// Max number of cells read during a cycle.
+#define SPINWAIT_MAX_CELLS 32
+/// Max number of stack cells a cycle may touch.
+#define SPINWAIT_MAX_STACK 16
+
+/// What the main loop should do with the IP, returned by spinwait_before().
+typedef enum spinwaitAction {
+	swNone,   ///< Nothing, just execute the instruction.
+	swTrack,  ///< Execute, then call spinwait_after().
+	swParked, ///< The IP was parked, skip it.
+} spinwaitAction;
+
+/// A watch on a cell, for a parked IP.
+typedef struct s_spinWatch {
+	struct s_spinWatch  * next;     ///< Next watch in the same hash bucket.
+	struct s_spinWatch ** prevNext; ///< Pointer to the pointer to this watch.
+	funge_vector          cell;     ///< Cell that is watched.
+	instructionPointer  * ip;       ///< IP to wake.
+} spinWatch;
+
+/// Spin-wait detection state for an IP.
+/// @warning Don't access directly, except via the macros below.
+typedef struct s_spinState {
+	bool          parked;         ///< Is the IP parked?
+	bool          recording;      ///< Have we taken the snapshot yet?
+	size_t        slots;          ///< Ticks recorded so far (cycle length once parked).
+	size_t        skipped;        ///< Ticks missed while parked.
+	funge_vector  startPosition;  ///< Position at start of cycle.
+	funge_vector  startDelta;     ///< Delta at start of cycle.
+	size_t        startTop;       ///< Stack size at start of cycle.
+	size_t        snapshotBase;   ///< Stack index of snapshot[0].
+	size_t        lowWater;       ///< Lowest stack index touched during the cycle.
+	size_t        wrapCount;      ///< Funge-Space wrap counter before last instruction.
+	funge_cell    lastOpcode;     ///< Last instruction executed.
+	funge_vector  lastPosition;   ///< Position of last instruction executed.
+	size_t        cellCount;      ///< Number of entries used in watches.
+	funge_cell    snapshot[SPINWAIT_MAX_STACK]; ///< Top of stack at start of cycle.
+	spinWatch     watches[SPINWAIT_MAX_CELLS];  ///< Watches on the cells read during the cycle.
+} spinState;
+
+/// Number of IPs that have watches on cells (parked or being recorded).
+/// Only read this, don't change it.
+extern size_t spinwait_watcher_count;
+
+/**
+ * Start watching an IP for a spin-wait.
+ * Called from the main loop when an IP executes g and ip->spinCountdown
+ * reaches zero.
+ * @param ip IP to watch.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void spinwait_start(instructionPointer * restrict ip);
+
+/**
+ * Called from the main loop before an IP with a spin state executes an
+ * instruction.
+ * @param ip IP that is about to execute.
+ * @param opcode Instruction it is about to execute.
+ * @param newSlot True if this is the first instruction of the IP in this round.
+ * @return What to do, see spinwaitAction.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+spinwaitAction spinwait_before(instructionPointer * restrict ip,
+                               funge_cell opcode, bool newSlot);
+
+/**
+ * Called from the main loop after an instruction that spinwait_before()
+ * returned swTrack for, once the IP has been moved.
+ * @param ip IP that executed.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void spinwait_after(instructionPointer * restrict ip);
+
+/// Check if an IP is parked.
+#define spinwait_is_parked(m_ip) ((m_ip)->spinState != NULL && (m_ip)->spinState->parked)
+
+/// Count a tick that a parked IP missed.
+#define spinwait_skip(m_ip) do { (m_ip)->spinState->skipped++; } while(0)
+
+/**
+ * Stop watching an IP. If it is parked it is woken up (and catches up on the
+ * ticks it missed), otherwise any ongoing detection is dropped.
+ * @param ip IP to release.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void spinwait_release(instructionPointer * restrict ip);
+
+/**
+ * Free the spin state of an IP without waking it. Used when freeing the IP.
+ * @param ip IP to operate on.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void spinwait_forget(instructionPointer * restrict ip);
+
+/**
+ * Wake IPs watching a cell, and restart detection for IPs that were still
+ * recording a cycle. Must be called before the cell is changed.
+ * Only call this if spinwait_watcher_count is non-zero.
+ * @param position Cell about to be written.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void spinwait_notify_write(const funge_vector * restrict position);
+
+/**
+ * Like spinwait_notify_write(), for all cells in an area.
+ * Only call this if spinwait_watcher_count is non-zero.
+ * @param min Top left corner of the area.
+ * @param max Bottom right corner of the area (inclusive).
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void spinwait_notify_area(const funge_vector * restrict min,
+                          const funge_vector * restrict max);
+
+#endif /* SPINWAIT_PARKING */
+
+#endif
@@ -31,6 +31,18 @@
 
 /// How many new items to allocate in one go?
 #define ALLOCSIZE_STACK 4096
+/// Stacks double in size until they are this large, then grow by this much.
+#define STACK_GROWTH_CAP (ALLOCSIZE_STACK * 256)
+/// Stacks smaller than this are never shrunk.
+#define STACK_SHRINK_MIN (ALLOCSIZE_STACK * 16)
+/// How many stack_trim() in a row must find the stack mostly unused before
+/// it is shrunk.
+#define STACK_SHRINK_PATIENCE 8
+/// Discarding at least this many items at once calls stack_trim().
+#define STACK_TRIM_DISCARD ALLOCSIZE_STACK
+/// { and } hand over the whole buffer instead of copying when moving at
+/// least this many items (and the items left behind are fewer).
+#define STACK_ADOPT_MIN 64
 /// How many stack pointers to allocate for the stack stack in one go.
 #define ALLOCSIZE_STACKSTACK 32
 
@@ -51,6 +63,8 @@ funge_stack * stack_create(void)
 	}
 	tmp->size = ALLOCSIZE_STACK;
 	tmp->top = 0;
+	tmp->base = 0;
+	tmp->sparse = 0;
 	return tmp;
 }
 
@@ -59,7 +73,7 @@ FUNGE_ATTR_FAST void stack_free(funge_stack * stack)
 	if (FUNGE_UNLIKELY(!stack))
 		return;
 	if (FUNGE_LIKELY(stack->entries != NULL)) {
-		free(stack->entries);
+		free(stack->entries - stack->base);
 		stack->entries = NULL;
 	}
 	free(stack);
@@ -80,6 +94,8 @@ static inline funge_stack * stack_duplicate(const funge_stack * old)
 	}
 	tmp->size = old->top + 1;
 	tmp->top = old->top;
+	tmp->base = 0;
+	tmp->sparse = 0;
 	// Not sure if memcpy() on 0 is well defined, so lets be careful.
 	if (tmp->top != 0)
 		memcpy(tmp->entries, old->entries, sizeof(funge_cell) * tmp->top);
@@ -97,26 +113,70 @@ static void stack_oom(void)
  * Basic push/pop/peeks and prealloc *
  *************************************/
 
+/**
+ * Move the entries to the start of the allocation, making the unused cells
+ * before them (if any) available.
+ */
 FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
-static inline void stack_prealloc_space(funge_stack * restrict stack, size_t minfree)
+static void stack_compact(funge_stack * restrict stack)
 {
-	if ((stack->top + minfree) >= stack->size) {
-		size_t newsize = stack->size + minfree;
-		size_t allocation_size;
+	funge_cell * start = stack->entries - stack->base;
+	if (stack->top != 0)
+		memmove(start, stack->entries, stack->top * sizeof(funge_cell));
+	stack->entries = start;
+	stack->size += stack->base;
+	stack->base = 0;
+}
+
+/**
+ * Make room for at least minfree more items. Growth is geometric up to
+ * STACK_GROWTH_CAP and linear after that, so deep stacks don't end up
+ * copying everything for every ALLOCSIZE_STACK items pushed.
+ * Returns false on OOM, leaving the stack untouched.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_NOINLINE FUNGE_ATTR_WARN_UNUSED
+static bool stack_grow(funge_stack * restrict stack, size_t minfree)
+{
+	size_t newsize, allocation_size;
+	size_t minsize = stack->top + minfree + 1;
+	funge_cell* newentries;
+
+	if (stack->base != 0) {
+		stack_compact(stack);
+		if ((stack->top + minfree) < stack->size)
+			return true;
+	}
+	if (stack->size < STACK_GROWTH_CAP)
+		newsize = stack->size * 2;
+	else
+		newsize = stack->size + STACK_GROWTH_CAP;
+	if (newsize < minsize) {
 		// Round upwards to whole ALLOCSIZE_STACK sized blocks.
-		newsize += ALLOCSIZE_STACK - (newsize % ALLOCSIZE_STACK);
+		newsize = minsize + ALLOCSIZE_STACK - (minsize % ALLOCSIZE_STACK);
+	}
 
-		// Guard against overflow.
-		allocation_size = newsize * sizeof(funge_cell);
-		if (FUNGE_UNLIKELY(allocation_size < newsize))
-		{
-			stack_oom();
-		}
-		stack->entries = (funge_cell*)realloc(stack->entries, allocation_size);
-		if (FUNGE_UNLIKELY(!stack->entries)) {
+	// Guard against overflow.
+	if (FUNGE_UNLIKELY(newsize < minsize))
+		return false;
+	allocation_size = newsize * sizeof(funge_cell);
+	if (FUNGE_UNLIKELY(allocation_size / sizeof(funge_cell) != newsize))
+		return false;
+	newentries = (funge_cell*)realloc(stack->entries, allocation_size);
+	if (FUNGE_UNLIKELY(!newentries))
+		return false;
+	stack->entries = newentries;
+	stack->size = newsize;
+	// It is clearly in use.
+	stack->sparse = 0;
+	return true;
+}
+
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void stack_prealloc_space(funge_stack * restrict stack, size_t minfree)
+{
+	if (FUNGE_UNLIKELY((stack->top + minfree) >= stack->size)) {
+		if (FUNGE_UNLIKELY(!stack_grow(stack, minfree)))
 			stack_oom();
-		}
-		stack->size = newsize;
 	}
 }
 
@@ -136,12 +196,8 @@ FUNGE_ATTR_FAST void stack_push(funge_stack * restrict stack, funge_cell value)
 
 	// Do we need to realloc?
 	if (FUNGE_UNLIKELY(stack->top == stack->size)) {
-		funge_cell* new_entries = (funge_cell*)realloc(stack->entries, (stack->size + ALLOCSIZE_STACK) * sizeof(funge_cell));
-		if (FUNGE_UNLIKELY(!new_entries)) {
+		if (FUNGE_UNLIKELY(!stack_grow(stack, 1)))
 			stack_oom();
-		}
-		stack->entries = new_entries;
-		stack->size += ALLOCSIZE_STACK;
 	}
 	stack->entries[stack->top] = value;
 	stack->top++;
@@ -166,6 +222,41 @@ FUNGE_ATTR_FAST void stack_discard(funge_stack * restrict stack, size_t n)
 	} else {
 		stack->top = 0;
 	}
+	if (FUNGE_UNLIKELY(n >= STACK_TRIM_DISCARD))
+		stack_trim(stack);
+}
+
+FUNGE_ATTR_FAST void stack_trim(funge_stack * restrict stack)
+{
+	size_t newsize;
+	funge_cell* newentries;
+
+	assert(stack != NULL);
+
+	if (FUNGE_UNLIKELY(stack->base != 0))
+		stack_compact(stack);
+	if (FUNGE_LIKELY(stack->size < STACK_SHRINK_MIN))
+		return;
+	// Still using more than an eighth of it?
+	if (stack->top > stack->size / 8) {
+		stack->sparse = 0;
+		return;
+	}
+	if (++stack->sparse < STACK_SHRINK_PATIENCE)
+		return;
+	stack->sparse = 0;
+
+	// Leave some room to grow again without reallocating right away.
+	newsize = stack->top * 2 + ALLOCSIZE_STACK;
+	newsize += ALLOCSIZE_STACK - (newsize % ALLOCSIZE_STACK);
+	if (newsize >= stack->size)
+		return;
+	newentries = (funge_cell*)realloc(stack->entries, newsize * sizeof(funge_cell));
+	// If shrinking failed we just keep the old allocation.
+	if (FUNGE_LIKELY(newentries != NULL)) {
+		stack->entries = newentries;
+		stack->size = newsize;
+	}
 }
 
 
@@ -191,16 +282,235 @@ FUNGE_ATTR_FAST inline funge_cell stack_get_index(const funge_stack * restrict s
 	return stack->entries[index - 1];
 }
 
+/******************
+ * String kernels *
+ ******************/
+
+/*
+ * Logic to select SSE2/AVX2 or pure C versions of the kernels used by the
+ * string functions below.
+ *
+ * STACK_SSE2          - SSE2 versions of all kernels.
+ * STACK_AVX2          - AVX2 zero search, always used.
+ * STACK_AVX2_DISPATCH - AVX2 zero search, used if the CPU supports it.
+ */
+
+#undef STACK_SSE2
+#undef STACK_AVX2
+#undef STACK_AVX2_DISPATCH
+
+// We don't want SSE if testing with klee.
+#if defined(CFUNGE_COMP_GCC_COMPAT) && defined(CFUNGE_ARCH_X86) \
+    && defined(__SSE2__) && !defined(CFUN_NO_SSE) && !defined(CFUN_KLEE_TEST)
+#  define STACK_SSE2
+#  if defined(__AVX2__)
+#    define STACK_AVX2
+#  elif (defined(CFUNGE_COMP_GCC) && ((__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) \
+        || (defined(CFUNGE_COMP_CLANG) && ((__clang_major__ > 3) || (__clang_major__ == 3 && __clang_minor__ >= 8)))
+#    define STACK_AVX2_DISPATCH
+#  endif
+#endif
+
+#ifdef STACK_SSE2
+#  include <emmintrin.h>
+/// Number of cells in a 128-bit register.
+#  define CELLS_PER_XMM (16 / sizeof(funge_cell))
+/// Shuffle that reverses the cells in a 128-bit register.
+#  ifdef USE64
+#    define CELL_REVERSE_SHUFFLE _MM_SHUFFLE(1, 0, 3, 2)
+#  else
+#    define CELL_REVERSE_SHUFFLE _MM_SHUFFLE(0, 1, 2, 3)
+#  endif
+#endif
+#if defined(STACK_AVX2) || defined(STACK_AVX2_DISPATCH)
+#  include <immintrin.h>
+/// Number of cells in a 256-bit register.
+#  define CELLS_PER_YMM (32 / sizeof(funge_cell))
+#endif
+#ifdef STACK_AVX2
+#  define STACK_TARGET_AVX2
+#else
+#  define STACK_TARGET_AVX2 FUNGE_ATTR((target("avx2")))
+#endif
+
+/// Find the last 0 below index top. Returns the number of cells above it,
+/// or top if there is no 0.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline size_t find_zero_c(const funge_cell * restrict entries, size_t top, size_t i)
+{
+	for (; i > 0; i--) {
+		if (entries[i - 1] == 0)
+			return top - i;
+	}
+	return top;
+}
+
+// These may be called through a function pointer, so no FUNGE_ATTR_FAST.
+// With STACK_AVX2 the SSE2 version is never used.
+#if defined(STACK_SSE2) && !defined(STACK_AVX2)
+FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static size_t find_zero_sse2(const funge_cell * restrict entries, size_t top)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = top;
+	for (; i >= CELLS_PER_XMM; i -= CELLS_PER_XMM) {
+		__m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(const void*)&entries[i - CELLS_PER_XMM]), zero);
+#  ifdef USE64
+		// Both halves must be zero.
+		eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+#  endif
+		if (_mm_movemask_epi8(eq) != 0)
+			break;
+	}
+	// Find the exact cell (or finish the tail).
+	return find_zero_c(entries, top, i);
+}
+#endif
+
+#if defined(STACK_AVX2) || defined(STACK_AVX2_DISPATCH)
+FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED STACK_TARGET_AVX2
+static size_t find_zero_avx2(const funge_cell * restrict entries, size_t top)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = top;
+	for (; i >= CELLS_PER_YMM; i -= CELLS_PER_YMM) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(const void*)&entries[i - CELLS_PER_YMM]);
+#  ifdef USE64
+		__m256i eq = _mm256_cmpeq_epi64(v, zero);
+#  else
+		__m256i eq = _mm256_cmpeq_epi32(v, zero);
+#  endif
+		if (_mm256_movemask_epi8(eq) != 0)
+			break;
+	}
+	return find_zero_c(entries, top, i);
+}
+#endif
+
+#ifdef STACK_AVX2_DISPATCH
+typedef size_t (*find_zero_func)(const funge_cell * restrict entries, size_t top);
+static size_t find_zero_select(const funge_cell * restrict entries, size_t top);
+/// Selected on first use.
+static find_zero_func find_zero_impl = &find_zero_select;
+
+static size_t find_zero_select(const funge_cell * restrict entries, size_t top)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		find_zero_impl = &find_zero_avx2;
+	else
+		find_zero_impl = &find_zero_sse2;
+	return find_zero_impl(entries, top);
+}
+#  define find_zero(m_entries, m_top) find_zero_impl((m_entries), (m_top))
+#elif defined(STACK_AVX2)
+#  define find_zero(m_entries, m_top) find_zero_avx2((m_entries), (m_top))
+#elif defined(STACK_SSE2)
+#  define find_zero(m_entries, m_top) find_zero_sse2((m_entries), (m_top))
+#else
+#  define find_zero(m_entries, m_top) find_zero_c((m_entries), (m_top), (m_top))
+#endif
+
+#ifdef STACK_SSE2
+/// Load 4 cells and return their low 32 bits in reverse order.
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline __m128i load4_reversed(const funge_cell * restrict src)
+{
+#  ifdef USE64
+	__m128i lo = _mm_loadu_si128((const __m128i*)(const void*)src);
+	__m128i hi = _mm_loadu_si128((const __m128i*)(const void*)(src + 2));
+	return _mm_unpacklo_epi64(_mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 0, 0, 2)),
+	                          _mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 0, 0, 2)));
+#  else
+	return _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(const void*)src),
+	                         _MM_SHUFFLE(0, 1, 2, 3));
+#  endif
+}
+#endif
+
+/**
+ * Copy cells to bytes in reverse order (dst[i] = src_end[-1 - i]),
+ * truncating each cell to a byte.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void copy_reverse_narrow(unsigned char * restrict dst,
+                                       const funge_cell * restrict src_end,
+                                       size_t len)
+{
+	size_t i = 0;
+#ifdef STACK_SSE2
+	const __m128i mask = _mm_set1_epi32(0xff);
+	for (; i + 16 <= len; i += 16) {
+		const funge_cell * src = src_end - i - 16;
+		__m128i a = _mm_and_si128(load4_reversed(src + 12), mask);
+		__m128i b = _mm_and_si128(load4_reversed(src + 8), mask);
+		__m128i c = _mm_and_si128(load4_reversed(src + 4), mask);
+		__m128i d = _mm_and_si128(load4_reversed(src), mask);
+		_mm_storeu_si128((__m128i*)(void*)&dst[i],
+		                 _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] = (unsigned char)src_end[-1 - (ssize_t)i];
+}
+
+/**
+ * Copy bytes to cells in reverse order (dst[i] = src[len - 1 - i]),
+ * zero extending each byte.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void copy_reverse_widen(funge_cell * restrict dst,
+                                      const unsigned char * restrict src,
+                                      size_t len)
+{
+	size_t i = 0;
+#ifdef STACK_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= len; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i*)(const void*)&src[len - i - 16]);
+		__m128i words[2] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+		// Highest source byte goes to the lowest destination cell.
+		for (int w = 0; w < 2; w++) {
+			__m128i hi = _mm_shuffle_epi32(_mm_unpackhi_epi16(words[1 - w], zero), _MM_SHUFFLE(0, 1, 2, 3));
+			__m128i lo = _mm_shuffle_epi32(_mm_unpacklo_epi16(words[1 - w], zero), _MM_SHUFFLE(0, 1, 2, 3));
+			funge_cell * out = &dst[i + (size_t)w * 8];
+#  ifdef USE64
+			_mm_storeu_si128((__m128i*)(void*)&out[0], _mm_unpacklo_epi32(hi, zero));
+			_mm_storeu_si128((__m128i*)(void*)&out[2], _mm_unpackhi_epi32(hi, zero));
+			_mm_storeu_si128((__m128i*)(void*)&out[4], _mm_unpacklo_epi32(lo, zero));
+			_mm_storeu_si128((__m128i*)(void*)&out[6], _mm_unpackhi_epi32(lo, zero));
+#  else
+			_mm_storeu_si128((__m128i*)(void*)&out[0], hi);
+			_mm_storeu_si128((__m128i*)(void*)&out[4], lo);
+#  endif
+		}
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] = src[len - 1 - i];
+}
+
+/// Copy cells in reverse order (dst[i] = src[len - 1 - i]).
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void copy_reverse_cells(funge_cell * restrict dst,
+                                      const funge_cell * restrict src,
+                                      size_t len)
+{
+	size_t i = 0;
+#ifdef STACK_SSE2
+	for (; i + CELLS_PER_XMM <= len; i += CELLS_PER_XMM) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(const void*)&src[len - i - CELLS_PER_XMM]);
+		_mm_storeu_si128((__m128i*)(void*)&dst[i], _mm_shuffle_epi32(v, CELL_REVERSE_SHUFFLE));
+	}
+#endif
+	for (; i < len; i++)
+		dst[i] = src[len - 1 - i];
+}
+
 FUNGE_ATTR_FAST inline size_t stack_strlen(const funge_stack * restrict stack)
 {
 	paranoid_assert(stack != NULL);
-	// TODO: Maybe scan two cells at once if we are using 32-bit cells on a
-	// 64-bit system?
-	for (size_t i = stack->top; i > 0; i--) {
-		if (stack->entries[i - 1] == 0)
-			return stack->top - i;
-	}
-	return stack->top;
+	return find_zero(stack->entries, stack->top);
 }
 
 
@@ -233,71 +543,68 @@ FUNGE_ATTR_FAST void stack_push_string(funge_stack * restrict stack, const unsig
 	assert(stack != NULL);
 	// Increment it once or it won't work
 	stack_prealloc_space(stack, len + 1);
-	{
-		const size_t top = stack->top + len;
-		for (ssize_t i = (ssize_t)len; i >= 0; i--)
-			stack->entries[top - (size_t)i] = str[i];
-		stack->top += len + 1;
-	}
+	// The terminating 0 ends up at the bottom.
+	copy_reverse_widen(&stack->entries[stack->top], str, len + 1);
+	stack->top += len + 1;
 }
 
 FUNGE_ATTR_FAST unsigned char *stack_pop_string(funge_stack * restrict stack, size_t * restrict len)
 {
-	funge_cell c;
-	size_t index = 0;
+	size_t length;
 	unsigned char *buf;
 	paranoid_assert(stack != NULL);
-	// FIXME: This may very likely be more than is needed.
-	buf = (unsigned char*)malloc((stack->top + 1) * sizeof(unsigned char));
+	length = stack_strlen(stack);
+	buf = (unsigned char*)malloc((length + 1) * sizeof(unsigned char));
 	if (FUNGE_UNLIKELY(!buf)) {
 		if (len)
 			*len = 0;
 		return NULL;
 	}
 
-	while ((c = stack_pop(stack)) != '\0') {
-		buf[index++] = (unsigned char)c;
-	}
-	buf[index] = '\0';
+	stack_pop_string_into(stack, buf, length);
 	if (len)
-		*len = index;
+		*len = length;
 	return buf;
 }
 
+FUNGE_ATTR_FAST void stack_pop_string_into(funge_stack * restrict stack, unsigned char * restrict buf, size_t length)
+{
+	paranoid_assert(stack != NULL);
+	paranoid_assert(length == stack_strlen(stack));
+	copy_reverse_narrow(buf, &stack->entries[stack->top], length);
+	buf[length] = '\0';
+	// Pop the string and the 0 (if there was one, else it is implicit).
+	stack->top -= (length < stack->top) ? length + 1 : length;
+}
+
 FUNGE_ATTR_FAST void stack_push_string_multibyte(funge_stack * restrict stack, const funge_cell * restrict str, size_t len)
 {
 	assert(str != NULL);
 	assert(stack != NULL);
 	// Increment it once or it won't work
 	stack_prealloc_space(stack, len + 1);
-	{
-		const size_t top = stack->top + len;
-		for (ssize_t i = (ssize_t)len; i >= 0; i--)
-			stack->entries[top - (size_t)i] = str[i];
-		stack->top += len + 1;
-	}
+	copy_reverse_cells(&stack->entries[stack->top], str, len + 1);
+	stack->top += len + 1;
 }
 
 FUNGE_ATTR_FAST funge_cell *stack_pop_string_multibyte(funge_stack * restrict stack, size_t * restrict len)
 {
-	funge_cell c;
-	size_t index = 0;
+	size_t length;
 	funge_cell *buf;
 	paranoid_assert(stack != NULL);
-	// FIXME: This may very likely be more than is needed.
-	buf = (funge_cell*)malloc((stack->top + 1) * sizeof(funge_cell));
+	length = stack_strlen(stack);
+	buf = (funge_cell*)malloc((length + 1) * sizeof(funge_cell));
 	if (FUNGE_UNLIKELY(!buf)) {
 		if (len)
 			*len = 0;
 		return NULL;
 	}
 
-	while ((c = stack_pop(stack)) != '\0') {
-		buf[index++] = c;
-	}
-	buf[index] = '\0';
+	copy_reverse_cells(buf, &stack->entries[stack->top - length], length);
+	buf[length] = '\0';
+	stack->top -= (length < stack->top) ? length + 1 : length;
 	if (len)
-		*len = index;
+		*len = length;
 	return buf;
 }
 
@@ -345,6 +652,42 @@ FUNGE_ATTR_FAST void stack_swap_top(funge_stack * restrict stack)
 	stack_push_no_check(stack, b);
 }
 
+FUNGE_ATTR_FAST void stack_push_repeated(funge_stack * restrict stack, funge_cell value, size_t count)
+{
+	funge_cell * restrict entries;
+	paranoid_assert(stack != NULL);
+	stack_prealloc_space(stack, count);
+	entries = &stack->entries[stack->top];
+	if (value == 0) {
+		memset(entries, 0, count * sizeof(funge_cell));
+	} else {
+		for (size_t i = 0; i < count; i++)
+			entries[i] = value;
+	}
+	stack->top += count;
+}
+
+FUNGE_ATTR_FAST void stack_push_cells(funge_stack * restrict stack, const funge_cell * restrict cells, size_t count)
+{
+	paranoid_assert(stack != NULL);
+	stack_prealloc_space(stack, count);
+	memcpy(&stack->entries[stack->top], cells, count * sizeof(funge_cell));
+	stack->top += count;
+}
+
+FUNGE_ATTR_FAST void stack_pop_cells(funge_stack * restrict stack, funge_cell * restrict cells, size_t count)
+{
+	size_t have = (stack->top < count) ? stack->top : count;
+	size_t missing = count - have;
+
+	paranoid_assert(stack != NULL);
+	// Popping past the bottom gives zeros.
+	memset(cells, 0, missing * sizeof(funge_cell));
+	memcpy(cells + missing, &stack->entries[stack->top - have], have * sizeof(funge_cell));
+	stack->top -= have;
+	if (FUNGE_UNLIKELY(count >= STACK_TRIM_DISCARD))
+		stack_trim(stack);
+}
 
 #ifndef NDEBUG
 /*************
@@ -388,6 +731,64 @@ void stack_print_top(const funge_stack * stack)
  * Stack-stacks *
  ****************/
 
+/*
+ * Stacks created by { are kept around when } drops them, sorted by size, so
+ * that code doing { and } in a loop doesn't hit malloc every time.
+ * Class n holds stacks with room for at least ALLOCSIZE_STACK << n items.
+ */
+/// Number of size classes.
+#define STACK_ARENA_CLASSES 6
+/// Max number of stacks kept in each class.
+#define STACK_ARENA_DEPTH 4
+
+static funge_stack * stack_arena[STACK_ARENA_CLASSES][STACK_ARENA_DEPTH];
+static size_t stack_arena_count[STACK_ARENA_CLASSES];
+
+/// Get an empty stack with room for more than minsize items, or NULL if
+/// there is none.
+FUNGE_ATTR_FAST FUNGE_ATTR_WARN_UNUSED
+static inline funge_stack * stack_arena_get(size_t minsize)
+{
+	for (size_t i = 0; i < STACK_ARENA_CLASSES; i++) {
+		if (stack_arena_count[i] != 0 && ((size_t)ALLOCSIZE_STACK << i) > minsize) {
+			funge_stack * stack = stack_arena[i][--stack_arena_count[i]];
+			stack->top = 0;
+			stack_compact(stack);
+			stack->sparse = 0;
+			return stack;
+		}
+	}
+	return NULL;
+}
+
+/// Give a stack back to the arena (or free it if it doesn't fit).
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void stack_arena_put(funge_stack * stack)
+{
+	size_t i = 0;
+
+	if (stack->size < ALLOCSIZE_STACK
+	    || stack->size >= ((size_t)ALLOCSIZE_STACK << STACK_ARENA_CLASSES)) {
+		stack_free(stack);
+		return;
+	}
+	while (((size_t)ALLOCSIZE_STACK << (i + 1)) <= stack->size)
+		i++;
+	if (stack_arena_count[i] == STACK_ARENA_DEPTH) {
+		stack_free(stack);
+		return;
+	}
+	stack_arena[i][stack_arena_count[i]++] = stack;
+}
+
+FUNGE_ATTR_FAST void stackstack_arena_free(void)
+{
+	for (size_t i = 0; i < STACK_ARENA_CLASSES; i++) {
+		while (stack_arena_count[i] != 0)
+			stack_free(stack_arena[i][--stack_arena_count[i]]);
+	}
+}
+
 funge_stackstack * stackstack_create(void)
 {
 	funge_stackstack * stackStack;
@@ -467,26 +868,8 @@ FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
 static inline bool stack_prealloc_space_non_fatal(funge_stack * restrict stack, size_t minfree)
 {
 	paranoid_assert(stack != NULL);
-	if ((stack->top + minfree) >= stack->size) {
-		size_t newsize = stack->size + minfree;
-		size_t allocation_size;
-		funge_cell* newentries;
-		// Round upwards to whole ALLOCSIZE_STACKed blocks.
-		newsize += ALLOCSIZE_STACK - (newsize % ALLOCSIZE_STACK);
-
-		// Guard against overflow.
-		allocation_size = newsize * sizeof(funge_cell);
-		if (FUNGE_UNLIKELY(allocation_size < newsize))
-		{
-			return false;
-		}
-		newentries = (funge_cell*)realloc(stack->entries, allocation_size);
-		if (FUNGE_UNLIKELY(!newentries)) {
-			return false;
-		}
-		stack->entries = newentries;
-		stack->size = newsize;
-	}
+	if ((stack->top + minfree) >= stack->size)
+		return stack_grow(stack, minfree);
 	return true;
 }
 
@@ -522,6 +905,72 @@ inline void stack_bulk_copy(funge_stack * restrict dest,
 	dest->top += count;
 }
 
+/**
+ * Move the top count items of SOSS to the empty TOSS by handing the buffer of
+ * SOSS over to TOSS and copying the items left behind to the buffer of TOSS.
+ * Only worth it (and only valid) if fewer items are left behind than moved,
+ * in which case the buffer of TOSS has room for them.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void stack_adopt_top(funge_stack * restrict TOSS,
+                                   funge_stack * restrict SOSS, size_t count)
+{
+	funge_cell * entries = TOSS->entries;
+	size_t       base    = TOSS->base;
+	size_t       size    = TOSS->size;
+	size_t       rest    = SOSS->top - count;
+
+	paranoid_assert(TOSS->top == 0);
+	paranoid_assert(rest < count && count <= SOSS->top);
+	paranoid_assert(rest < size);
+
+	TOSS->entries = SOSS->entries + rest;
+	TOSS->base    = SOSS->base + rest;
+	TOSS->size    = SOSS->size - rest;
+	TOSS->top     = count;
+
+	if (rest != 0)
+		memcpy(entries, SOSS->entries, rest * sizeof(funge_cell));
+	SOSS->entries = entries;
+	SOSS->base    = base;
+	SOSS->size    = size;
+	SOSS->top     = rest;
+}
+
+/**
+ * Push the top count items of TOSS on SOSS by copying the items of SOSS to
+ * just below them in the buffer of TOSS, and swapping the buffers. TOSS is
+ * left empty with the old buffer of SOSS. Only valid if there is room below
+ * the items in the buffer of TOSS.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static inline void stack_adopt_under(funge_stack * restrict SOSS,
+                                     funge_stack * restrict TOSS, size_t count)
+{
+	funge_cell * entries = SOSS->entries;
+	size_t       base    = SOSS->base;
+	size_t       size    = SOSS->size;
+	// Index in TOSS of the first item to move.
+	size_t       start   = TOSS->top - count;
+	funge_cell * dest;
+
+	paranoid_assert(count <= TOSS->top);
+	paranoid_assert(TOSS->base + start >= SOSS->top);
+
+	dest = TOSS->entries + start - SOSS->top;
+	if (SOSS->top != 0)
+		memcpy(dest, SOSS->entries, SOSS->top * sizeof(funge_cell));
+	SOSS->entries = dest;
+	SOSS->base    = TOSS->base + start - SOSS->top;
+	SOSS->size    = TOSS->size - start + SOSS->top;
+	SOSS->top    += count;
+
+	TOSS->entries = entries;
+	TOSS->base    = base;
+	TOSS->size    = size;
+	TOSS->top     = 0;
+}
+
 FUNGE_ATTR_FAST
 bool stackstack_begin(instructionPointer * ip, funge_cell count, const funge_vector * restrict storageOffset)
 {
@@ -534,17 +983,20 @@ bool stackstack_begin(instructionPointer * ip, funge_cell count, const funge_vec
 	// Set up variables
 	stackStack = ip->stackstack;
 
-	TOSS = stack_create();
-	if (FUNGE_UNLIKELY(!TOSS)) {
-		oom_stackstack(ip);
-		return false;
-	}
 	// Allocate enough space on the TOSS and reflect if not.
 	// This is count + 2 (storage offset)
-	if (FUNGE_UNLIKELY(!stack_prealloc_space_non_fatal(TOSS, ABS(count) + 2))) {
-		stack_free(TOSS);
-		oom_stackstack(ip);
-		return false;
+	TOSS = stack_arena_get(ABS(count) + 2);
+	if (!TOSS) {
+		TOSS = stack_create();
+		if (FUNGE_UNLIKELY(!TOSS)) {
+			oom_stackstack(ip);
+			return false;
+		}
+		if (FUNGE_UNLIKELY(!stack_prealloc_space_non_fatal(TOSS, ABS(count) + 2))) {
+			stack_free(TOSS);
+			oom_stackstack(ip);
+			return false;
+		}
 	}
 
 	// Extend the stack stack allocation if required:
@@ -563,7 +1015,10 @@ bool stackstack_begin(instructionPointer * ip, funge_cell count, const funge_vec
 	stackStack->current++;
 	stackStack->stacks[stackStack->current] = TOSS;
 
-	if (count > 0) {
+	if (count >= STACK_ADOPT_MIN && (size_t)count <= SOSS->top
+	    && SOSS->top - (size_t)count < (size_t)count) {
+		stack_adopt_top(TOSS, SOSS, (size_t)count);
+	} else if (count > 0) {
 		stack_bulk_copy(TOSS, SOSS, (size_t)count);
 		// Make it into a move.
 		if ((size_t)count > SOSS->top)
@@ -596,7 +1051,11 @@ bool stackstack_end(instructionPointer * ip, funge_cell count)
 	TOSS = stackStack->stacks[stackStack->current];
 	SOSS = stackStack->stacks[stackStack->current - 1];
 	storageOffset = stack_pop_vector(SOSS);
-	if (count > 0) {
+	if (count >= STACK_ADOPT_MIN && (size_t)count <= TOSS->top
+	    && SOSS->top < (size_t)count
+	    && TOSS->base + (TOSS->top - (size_t)count) >= SOSS->top) {
+		stack_adopt_under(SOSS, TOSS, (size_t)count);
+	} else if (count > 0) {
 		// Since TOSS is discarded there is no need to update it's top pointer.
 		stack_bulk_copy(SOSS, TOSS, (size_t)count);
 	} else if (count < 0) {
@@ -610,7 +1069,7 @@ bool stackstack_end(instructionPointer * ip, funge_cell count)
 	// TODO: Should we shrink stack stack allocation if difference is large?
 	// Needs testing to figure out.
 	stackStack->current--;
-	stack_free(TOSS);
+	stack_arena_put(TOSS);
 	return true;
 }
 
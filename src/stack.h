@@ -44,6 +44,10 @@ typedef struct funge_stack {
 	size_t      top;     /**< This is current top item in stack (may not be last item).
 	                          Note: One-indexed, as 0 = empty stack. */
 	funge_cell *entries; ///< Pointer to entries.
+	size_t      base;    /**< Number of unused cells in the allocation before entries.
+	                          Non-zero for stacks that took over the buffer of another
+	                          stack in stackstack_begin() or stackstack_end(). */
+	size_t      sparse;  ///< Number of stack_trim() calls in a row that found the stack mostly unused.
 } funge_stack;
 
 /// A Funge stack-stack.
@@ -80,6 +84,15 @@ funge_cell stack_pop(funge_stack * restrict stack);
  */
 FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
 void stack_discard(funge_stack * restrict stack, size_t n);
+/**
+ * Give memory back if the stack has been mostly unused for a while.
+ * Called after n and after discarding a lot of items. Only shrinks after
+ * several calls in a row found the stack mostly unused, so a program that
+ * keeps filling and clearing a large stack doesn't reallocate all the time.
+ * @param stack Pointer to stack to operate on.
+ */
+FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
+void stack_trim(funge_stack * restrict stack);
 /**
  * Stack peek.
  */
@@ -133,6 +146,16 @@ void stack_push_string(funge_stack * restrict stack,
 FUNGE_ATTR_MALLOC FUNGE_ATTR_WARN_UNUSED FUNGE_ATTR((nonnull(1))) FUNGE_ATTR_FAST
 unsigned char * stack_pop_string(funge_stack * restrict stack,
                                  size_t * restrict len);
+/**
+ * Pop a 0"gnirts" into a buffer provided by the caller.
+ * @param stack A pointer to the stack in question.
+ * @param buf Where to store the null-terminated string. Must have room for
+ *            length + 1 chars.
+ * @param length The string length, from stack_strlen().
+ */
+FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
+void stack_pop_string_into(funge_stack * restrict stack,
+                           unsigned char * restrict buf, size_t length);
 
 /**
  * Push a null-terminated multibyte-string to a 0"gnirts".
@@ -185,6 +208,23 @@ void stack_dup_top(funge_stack * restrict stack);
  */
 FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
 void stack_swap_top(funge_stack * restrict stack);
+/**
+ * Push the same value several times, as a faster version of calling
+ * stack_push() in a loop.
+ */
+FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
+void stack_push_repeated(funge_stack * restrict stack, funge_cell value, size_t count);
+/**
+ * Push several cells in order, so the last one ends up on top.
+ */
+FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
+void stack_push_cells(funge_stack * restrict stack, const funge_cell * restrict cells, size_t count);
+/**
+ * Pop several cells, the reverse of stack_push_cells(): the top of the stack
+ * ends up last in cells.
+ */
+FUNGE_ATTR_NONNULL FUNGE_ATTR_FAST
+void stack_pop_cells(funge_stack * restrict stack, funge_cell * restrict cells, size_t count);
 
 #ifndef DISABLE_TRACE
 /**
@@ -208,6 +248,12 @@ funge_stackstack * stackstack_create(void);
  */
 FUNGE_ATTR_FAST
 void stackstack_free(funge_stackstack * me);
+/**
+ * Free the stacks kept around for reuse by stackstack_begin(), used at exit
+ * when debugging.
+ */
+FUNGE_ATTR_FAST
+void stackstack_arena_free(void);
 
 #ifdef CONCURRENT_FUNGE
 /**
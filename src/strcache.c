@@ -0,0 +1,228 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "global.h"
+#include "strcache.h"
+
+#include "settings.h"
+#include "stack.h"
+#include "funge-space/funge-space.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h> /* memcpy */
+
+/// Number of cache entries, must be a power of two.
+#define STRCACHE_ENTRIES 64
+/// Longest literal (in cells walked over) that we cache.
+#define STRCACHE_MAX_LENGTH 4096
+
+/// A cached string literal.
+typedef struct s_strcacheEntry {
+	funge_vector  start;  ///< Position of the opening ".
+	funge_vector  delta;  ///< Delta the literal was entered with.
+	funge_vector  end;    ///< Position of the closing ".
+	size_t        steps;  ///< Number of steps from start to end.
+	size_t        count;  ///< Number of cells to push.
+	funge_cell  * cells;  ///< Cells to push, in push order. NULL if not valid.
+} strcacheEntry;
+
+funge_vector strcache_min = { FUNGECELL_MAX, FUNGECELL_MAX };
+funge_vector strcache_max = { FUNGECELL_MIN, FUNGECELL_MIN };
+
+static strcacheEntry entries[STRCACHE_ENTRIES];
+/// Number of valid entries.
+static size_t validEntries = 0;
+/// Scratch buffer used when decoding a literal.
+static funge_cell *scratch = NULL;
+
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static inline size_t strcache_hash(const funge_vector * restrict position,
+                                   const funge_vector * restrict delta)
+{
+	funge_unsigned_cell h = (funge_unsigned_cell)position->x * 31 + (funge_unsigned_cell)position->y;
+	h = h * 7 + (funge_unsigned_cell)delta->x * 3 + (funge_unsigned_cell)delta->y;
+	return (size_t)h & (STRCACHE_ENTRIES - 1);
+}
+
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+static void strcache_invalidate(strcacheEntry * restrict entry)
+{
+	free(entry->cells);
+	entry->cells = NULL;
+	if (--validEntries == 0) {
+		strcache_min.x = strcache_min.y = FUNGECELL_MAX;
+		strcache_max.x = strcache_max.y = FUNGECELL_MIN;
+	}
+}
+
+/// Is the cell one of those walked over by the literal?
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_PURE FUNGE_ATTR_WARN_UNUSED
+static bool strcache_entry_contains(const strcacheEntry * restrict entry,
+                                    const funge_vector * restrict position)
+{
+	funge_cell ox = position->x - entry->start.x;
+	funge_cell oy = position->y - entry->start.y;
+	funge_cell k;
+	if (entry->delta.x != 0) {
+		if (ox % entry->delta.x != 0)
+			return false;
+		k = ox / entry->delta.x;
+		if (oy != k * entry->delta.y)
+			return false;
+	} else if (entry->delta.y != 0) {
+		if (ox != 0 || oy % entry->delta.y != 0)
+			return false;
+		k = oy / entry->delta.y;
+	} else {
+		return ox == 0 && oy == 0;
+	}
+	return k >= 0 && (funge_unsigned_cell)k <= entry->steps;
+}
+
+/**
+ * Decode the literal the IP is on, the same way handle_string_mode() in
+ * interpreter.c would.
+ * @return True if it could be cached.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+static bool strcache_fill(strcacheEntry * restrict entry,
+                          const instructionPointer * restrict ip)
+{
+	funge_vector pos = ip->position;
+	bool lastWasSpace = false;
+	size_t count = 0;
+	size_t steps = 0;
+
+	if (!scratch) {
+		scratch = malloc(STRCACHE_MAX_LENGTH * sizeof(funge_cell));
+		if (FUNGE_UNLIKELY(!scratch))
+			return false;
+	}
+
+	while (true) {
+		funge_cell value;
+		funge_vector next = { pos.x + ip->delta.x, pos.y + ip->delta.y };
+		fungespace_wrap(&next, &ip->delta);
+		// Where a literal wraps depends on the bounds, don't cache those.
+		if (next.x != pos.x + ip->delta.x || next.y != pos.y + ip->delta.y)
+			return false;
+		if (++steps == STRCACHE_MAX_LENGTH)
+			return false;
+		pos = next;
+		// Native memory (CFFI) can change without a write we would notice.
+		if (FUNGE_UNLIKELY(fungespace_is_native(&pos)))
+			return false;
+		value = fungespace_get(&pos);
+		if (value == '"')
+			break;
+		if (value != ' ') {
+			lastWasSpace = false;
+			scratch[count++] = value;
+		} else if (!lastWasSpace || setting_current_standard == stdver93) {
+			lastWasSpace = true;
+			scratch[count++] = value;
+		}
+	}
+
+	entry->cells = malloc((count ? count : 1) * sizeof(funge_cell));
+	if (FUNGE_UNLIKELY(!entry->cells))
+		return false;
+	memcpy(entry->cells, scratch, count * sizeof(funge_cell));
+	entry->start = ip->position;
+	entry->delta = ip->delta;
+	entry->end = pos;
+	entry->steps = steps;
+	entry->count = count;
+	validEntries++;
+
+	// Grow the covered area.
+	if (entry->start.x < strcache_min.x) strcache_min.x = entry->start.x;
+	if (entry->end.x   < strcache_min.x) strcache_min.x = entry->end.x;
+	if (entry->start.y < strcache_min.y) strcache_min.y = entry->start.y;
+	if (entry->end.y   < strcache_min.y) strcache_min.y = entry->end.y;
+	if (entry->start.x > strcache_max.x) strcache_max.x = entry->start.x;
+	if (entry->end.x   > strcache_max.x) strcache_max.x = entry->end.x;
+	if (entry->start.y > strcache_max.y) strcache_max.y = entry->start.y;
+	if (entry->end.y   > strcache_max.y) strcache_max.y = entry->end.y;
+	return true;
+}
+
+FUNGE_ATTR_FAST bool strcache_run(instructionPointer * restrict ip)
+{
+	strcacheEntry * entry;
+
+#ifndef DISABLE_TRACE
+	// Tracing should show each cell.
+	if (FUNGE_UNLIKELY(setting_trace_level != 0))
+		return false;
+#endif
+
+	entry = &entries[strcache_hash(&ip->position, &ip->delta)];
+	if (!entry->cells
+	    || entry->start.x != ip->position.x || entry->start.y != ip->position.y
+	    || entry->delta.x != ip->delta.x || entry->delta.y != ip->delta.y) {
+		if (entry->cells)
+			strcache_invalidate(entry);
+		if (!strcache_fill(entry, ip))
+			return false;
+	}
+
+	stack_push_cells(ip->stack, entry->cells, entry->count);
+	ip->position = entry->end;
+	ip->stringLastWasSpace = (entry->count != 0 && entry->cells[entry->count - 1] == ' ');
+	return true;
+}
+
+FUNGE_ATTR_FAST void strcache_notify_write(const funge_vector * restrict position)
+{
+	for (size_t i = 0; i < STRCACHE_ENTRIES; i++) {
+		strcacheEntry * entry = &entries[i];
+		if (entry->cells && strcache_entry_contains(entry, position))
+			strcache_invalidate(entry);
+	}
+}
+
+FUNGE_ATTR_FAST void strcache_notify_area(const funge_vector * restrict min,
+                                          const funge_vector * restrict max)
+{
+	if (min->x > strcache_max.x || max->x < strcache_min.x
+	    || min->y > strcache_max.y || max->y < strcache_min.y)
+		return;
+	// Rare enough that the whole cache can go.
+	for (size_t i = 0; i < STRCACHE_ENTRIES; i++) {
+		if (entries[i].cells)
+			strcache_invalidate(&entries[i]);
+	}
+}
+
+#ifndef NDEBUG
+FUNGE_ATTR_FAST void strcache_free(void)
+{
+	for (size_t i = 0; i < STRCACHE_ENTRIES; i++) {
+		if (entries[i].cells)
+			strcache_invalidate(&entries[i]);
+	}
+	free(scratch);
+	scratch = NULL;
+}
+#endif
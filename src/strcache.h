@@ -0,0 +1,91 @@
+/* -*- mode: C; coding: utf-8; tab-width: 4; indent-tabs-mode: t; c-basic-offset: 4 -*-
+ *
+ * cfunge - A standard-conforming Befunge93/98/109 interpreter in C.
+ * Copyright (C) 2008-2013 Arvid Norlander <VorpalBlade AT users.noreply.github.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at the proxy's option) any later version. Arvid Norlander is a
+ * proxy who can decide which future versions of the GNU General Public
+ * License can be used.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ * Cache for string literals.
+ *
+ * When an IP enters string mode, the whole literal can be pushed in one go,
+ * as long as no other IP can observe that it took one tick instead of one
+ * per character. The cells it would push are cached by position and delta of
+ * the opening quote, and the cache is invalidated when any cell of the
+ * literal is written.
+ */
+
+#ifndef FUNGE_HAD_SRC_STRCACHE_H
+#define FUNGE_HAD_SRC_STRCACHE_H
+
+#include "global.h"
+#include "ip.h"
+#include "vector.h"
+
+#include <stdbool.h>
+
+/// Top left corner of the area covered by cached literals.
+extern funge_vector strcache_min;
+/// Bottom right corner of the area covered by cached literals.
+extern funge_vector strcache_max;
+
+/// Could the cell be part of a cached literal? Check before calling
+/// strcache_notify_write().
+#define strcache_may_contain(m_pos) \
+	((m_pos)->x >= strcache_min.x && (m_pos)->x <= strcache_max.x \
+	 && (m_pos)->y >= strcache_min.y && (m_pos)->y <= strcache_max.y)
+
+/**
+ * Run a string literal in one go.
+ * Must only be called when no other IP could observe the difference in
+ * timing, and not from inside k.
+ * @param ip IP that is positioned on a " in code mode.
+ * @return True if the literal was pushed. The IP is then at the closing ",
+ *         back in code mode, and should be moved forward as usual.
+ *         False if the literal needs to be run normally.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL FUNGE_ATTR_WARN_UNUSED
+bool strcache_run(instructionPointer * restrict ip);
+
+/**
+ * Invalidate cached literals that a cell is part of. Must be called when the
+ * cell is written.
+ * @param position Cell that is written.
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void strcache_notify_write(const funge_vector * restrict position);
+
+/**
+ * Invalidate cached literals that may overlap an area. Must be called when
+ * the cells of the area change without going through fungespace_set().
+ * @param min Top left corner of the area.
+ * @param max Bottom right corner of the area (inclusive).
+ */
+FUNGE_ATTR_FAST FUNGE_ATTR_NONNULL
+void strcache_notify_area(const funge_vector * restrict min,
+                          const funge_vector * restrict max);
+
+#ifndef NDEBUG
+/**
+ * Free the cache, used at exit when debugging.
+ */
+FUNGE_ATTR_FAST
+void strcache_free(void);
+#endif
+
+#endif
@@ -6,6 +6,7 @@ import os
 import os.path
 import sys
 import subprocess
+import time
 
 _SUFFIX_MAP = {
     'b109': '109',
@@ -73,14 +74,35 @@ def main():
     expected_file_path_base = '.'.join(test.split('.')[:-1])
     ret_code = 0
     output = b''
+    # Standard input is taken from test.input if it exists.
+    input_file = subprocess.DEVNULL
+    if os.path.exists(expected_file_path_base + '.input'):
+        input_file = open(expected_file_path_base + '.input', mode='rb')
+    # Extra options for cfunge are taken from test.options if it exists.
+    options = []
+    if os.path.exists(expected_file_path_base + '.options'):
+        with open(expected_file_path_base + '.options') as options_file:
+            options = options_file.read().split()
+    # Or from test.slow-input, written to a pipe after a while, so that the
+    # program starts waiting for input before there is any.
+    slow_input = None
+    if os.path.exists(expected_file_path_base + '.slow-input'):
+        with open(expected_file_path_base + '.slow-input', mode='rb') as slow_file:
+            slow_input = slow_file.read()
+        input_file = subprocess.PIPE
     try:
-        output = subprocess.check_output([args.cfunge_path,
-                                          '-s', _SUFFIX_MAP[test_extension],
-                                          test],
-                                         env={'TEST_ENV': 'test'})
-    except subprocess.CalledProcessError as e:
-        ret_code = e.returncode
-        output = e.output
+        with subprocess.Popen([args.cfunge_path] + options +
+                              ['-s', _SUFFIX_MAP[test_extension], test],
+                              stdin=input_file,
+                              stdout=subprocess.PIPE,
+                              env={'TEST_ENV': 'test'}) as process:
+            if slow_input is not None:
+                time.sleep(0.5)
+            output, unused_err = process.communicate(slow_input)
+            ret_code = process.returncode
+    finally:
+        if input_file not in (subprocess.DEVNULL, subprocess.PIPE):
+            input_file.close()
 
     success = True
 